@@ -5,33 +5,47 @@
 #include "../common/veh_status_service.hpp"
 #include <thread>
 #include <iostream>
+#include <vector>
 
 namespace py = pybind11;
 
 class VsomeipClient {
 public:
-    VsomeipClient() {
+    // eventgroups: 구독할 상태 이벤트그룹 (기본: 전체)
+    explicit VsomeipClient(const std::vector<uint16_t> &eventgroups = {
+                               std::begin(STATUS_EVENTGROUPS), std::end(STATUS_EVENTGROUPS) })
+        : eventgroups_(eventgroups) {
         app_ = vsomeip::runtime::get()->create_application("veh_gui_client");
         if (!app_->init()) {
             std::cerr << "[vsomeip] init failed!\n";
             return;
         }
 
-        // 이벤트 핸들러 등록
-        app_->register_message_handler(
-            VEH_STATUS_SERVICE_ID,
-            VEH_STATUS_INSTANCE_ID,
-            VEH_STATUS_EVENT_ID,
-            [this](const std::shared_ptr<vsomeip::message> &msg) {
-                auto payload = msg->get_payload();
-                auto data = payload->get_data();
-                auto len = payload->get_length();
-                std::vector<uint8_t> vec(data, data + len);
-                uint16_t msg_type = msg->get_method();
-
-                if (py_callback_)
-                    py_callback_(msg_type, vec);
-            });
+        // 이벤트 핸들러 등록 (구독 그룹에 속한 StatusType별 이벤트만)
+        for_each_status_event(eventgroups_, [this](const StatusEventInfo &info) {
+            app_->register_message_handler(
+                VEH_STATUS_SERVICE_ID,
+                VEH_STATUS_INSTANCE_ID,
+                info.event,
+                [this](const std::shared_ptr<vsomeip::message> &msg) {
+                    auto payload = msg->get_payload();
+                    uint16_t msg_type = msg->get_method();  // 이벤트 ID
+                    if (!py_callback_) return;
+
+                    // 배치 페이로드도 레코드마다 [StatusType][값...]로 풀어서 콜백
+                    for_each_status_record(payload->get_data(), payload->get_length(),
+                        [&](uint8_t type, const uint8_t *val, size_t len, uint64_t rx_time_ns) {
+                            std::vector<uint8_t> vec;
+                            vec.reserve(1 + len);
+                            vec.push_back(type);
+                            vec.insert(vec.end(), val, val + len);
+                            if (with_timestamp_)
+                                py_callback_(msg_type, vec, rx_time_ns);
+                            else
+                                py_callback_(msg_type, vec);
+                        });
+                });
+        });
 
         // 별도 스레드에서 vsomeip 실행
         worker_ = std::thread([this]() {
@@ -40,14 +54,22 @@ public:
 
         // 서비스 및 이벤트 구독 요청
         app_->request_service(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID);
-        app_->subscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, VEH_STATUS_EVENT_ID);
+        for_each_status_event(eventgroups_, [this](const StatusEventInfo &info) {
+            app_->request_event(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID,
+                                info.event, { info.eventgroup },
+                                vsomeip::event_type_e::ET_EVENT,
+                                vsomeip::reliability_type_e::RT_UNRELIABLE);
+        });
+        for (auto group : eventgroups_)
+            app_->subscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, group);
 
         std::cout << "[vsomeip] Client started successfully.\n";
     }
 
     ~VsomeipClient() {
         try {
-            app_->unsubscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, VEH_STATUS_EVENT_ID);
+            for (auto group : eventgroups_)
+                app_->unsubscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, group);
             app_->release_service(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID);
             app_->stop();
             if (worker_.joinable()) worker_.join();
@@ -71,7 +93,10 @@ public:
         app_->send(msg);
     }
 
-    void set_event_callback(py::function callback) {
+    // with_timestamp=True: callback(msg_type, data, rx_time_ns)
+    //   rx_time_ns = 서버의 커널 CAN 수신 시각 (time.time_ns()와 같은 기준, 트레일러가 없으면 0)
+    void set_event_callback(py::function callback, bool with_timestamp) {
+        with_timestamp_ = with_timestamp;
         py_callback_ = callback;
     }
 
@@ -83,14 +108,27 @@ public:
 
 private:
     std::shared_ptr<vsomeip::application> app_;
+    std::vector<uint16_t> eventgroups_;
     py::function py_callback_;
+    bool with_timestamp_ = false;
     std::thread worker_;
 };
 
 PYBIND11_MODULE(synapse_vsomeip, m) {
     py::class_<VsomeipClient>(m, "VsomeipClient")
         .def(py::init<>())
+        .def(py::init<const std::vector<uint16_t> &>(), py::arg("eventgroups"))
         .def("send_command", &VsomeipClient::send_command)
-        .def("set_event_callback", &VsomeipClient::set_event_callback)
+        .def("set_event_callback", &VsomeipClient::set_event_callback,
+             py::arg("callback"), py::arg("with_timestamp") = false)
         .def("poll_events", &VsomeipClient::poll_events);
+
+    // 상태 이벤트그룹 / 이벤트 ID (콜백의 msg_type)
+    m.attr("SAFETY_EVENTGROUP")  = VEH_STATUS_SAFETY_EVENTGROUP_ID;
+    m.attr("SENSORS_EVENTGROUP") = VEH_STATUS_SENSORS_EVENTGROUP_ID;
+    m.attr("SESSION_EVENTGROUP") = VEH_STATUS_SESSION_EVENTGROUP_ID;
+    m.attr("AEB_EVENT")      = VEH_STATUS_AEB_EVENT_ID;
+    m.attr("AUTOPARK_EVENT") = VEH_STATUS_AUTOPARK_EVENT_ID;
+    m.attr("TOF_EVENT")      = VEH_STATUS_TOF_EVENT_ID;
+    m.attr("AUTH_EVENT")     = VEH_STATUS_AUTH_EVENT_ID;
 }
@@ -24,7 +24,8 @@ class VehicleControlGUI(QWidget):
         self.tof_distance = 0
 
         # ----- vsomeip 클라이언트 초기화 -----
-        self.client = sv.VsomeipClient()
+        # 표시하는 상태(AEB/자율주차/ToF)의 이벤트그룹만 구독 (인증 이벤트는 받지 않음)
+        self.client = sv.VsomeipClient([sv.SAFETY_EVENTGROUP, sv.SENSORS_EVENTGROUP])
         self.client.set_event_callback(self.on_status_update)
 
         # ----- UI 초기화 -----
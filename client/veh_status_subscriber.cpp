@@ -4,14 +4,16 @@
 #include <thread>
 #include <atomic>
 #include <sstream>
+#include <vector>
 #include "veh_logger.hpp"
 #include "veh_status_service.hpp"
 
 namespace {
 constexpr vsomeip::service_t  SERVICE_ID  = VEH_STATUS_SERVICE_ID;
 constexpr vsomeip::instance_t INSTANCE_ID = VEH_STATUS_INSTANCE_ID;
-constexpr vsomeip::event_t    EVENT_ID    = VEH_STATUS_EVENT_ID;
-constexpr vsomeip::eventgroup_t EVENT_GROUP = VEH_STATUS_EVENTGROUP_ID;
+
+// 콘솔에 모든 상태를 출력하므로 전체 이벤트그룹 구독
+constexpr const auto& EVENT_GROUPS = STATUS_EVENTGROUPS;
 
 std::atomic<bool> g_running{true};
 void on_signal(int) { g_running = false; }
@@ -33,9 +35,11 @@ public:
             std::bind(&VehStatusSubscriber::on_availability, this,
                       std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 
-        app_->register_message_handler(
-            SERVICE_ID, INSTANCE_ID, EVENT_ID,
-            std::bind(&VehStatusSubscriber::on_event, this, std::placeholders::_1));
+        for_each_status_event(EVENT_GROUPS, [this](const StatusEventInfo& info) {
+            app_->register_message_handler(
+                SERVICE_ID, INSTANCE_ID, info.event,
+                std::bind(&VehStatusSubscriber::on_event, this, std::placeholders::_1));
+        });
 
         return true;
     }
@@ -55,10 +59,13 @@ private:
 
     void on_availability(vsomeip::service_t, vsomeip::instance_t, bool available) {
         if (available) {
-            app_->request_event(SERVICE_ID, INSTANCE_ID, EVENT_ID, {EVENT_GROUP},
-                                vsomeip::event_type_e::ET_EVENT,
-                                vsomeip::reliability_type_e::RT_UNRELIABLE);
-            app_->subscribe(SERVICE_ID, INSTANCE_ID, EVENT_GROUP);
+            for_each_status_event(EVENT_GROUPS, [this](const StatusEventInfo& info) {
+                app_->request_event(SERVICE_ID, INSTANCE_ID, info.event, {info.eventgroup},
+                                    vsomeip::event_type_e::ET_EVENT,
+                                    vsomeip::reliability_type_e::RT_UNRELIABLE);
+            });
+            for (auto group : EVENT_GROUPS)
+                app_->subscribe(SERVICE_ID, INSTANCE_ID, group);
             std::cout << "[SUB] Connected to VEH_STATUS service." << std::endl;
         } else {
             std::cout << "[SUB] Service unavailable." << std::endl;
@@ -69,10 +76,14 @@ private:
         auto pl = msg->get_payload();
         if (!pl || pl->get_length() < 2) return;
 
-        const auto *data = pl->get_data();
-        uint8_t type = data[0];
-        const uint8_t *val = data + 1;
-        size_t len = pl->get_length() - 1;
+        // 단일 레코드 또는 배치 페이로드
+        if (!for_each_status_record(pl->get_data(), pl->get_length(),
+                [this](uint8_t type, const uint8_t *val, size_t len, uint64_t) { on_record(type, val, len); }))
+            std::cout << "[EVT] Truncated batch (len=" << pl->get_length() << ")" << std::endl;
+    }
+
+    void on_record(uint8_t type, const uint8_t *val, size_t len) {
+        if (len < 1) return;
 
         switch (type) {
             case (uint8_t)StatusType::AEB_STATE:
@@ -84,6 +95,7 @@ private:
                 break;
 
             case (uint8_t)StatusType::TOF_DISTANCE: {
+                if (len < 3) break;
                 // ToF 거리(mm): 3바이트 Big Endian
                 uint32_t mm = (val[0] << 16) | (val[1] << 8) | val[2];
                 std::cout << "[EVT] TOF_DISTANCE → " << mm << " mm" << std::endl;
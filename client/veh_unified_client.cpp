@@ -17,6 +17,9 @@
 
 using namespace std::chrono_literals;
 
+// 콘솔에 모든 상태 이벤트를 출력하므로 전체 이벤트그룹 구독
+constexpr const auto& STATUS_EVENT_GROUPS = STATUS_EVENTGROUPS;
+
 veh::Logger g_logger("logs/veh_unified_client.log");
 std::atomic<bool> g_running{true};
 void on_signal(int) { g_running = false; }
@@ -38,24 +41,29 @@ public:
                 app_->request_service(VEH_CONTROL_SERVICE_ID, VEH_CONTROL_INSTANCE_ID);
                 app_->request_service(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID);
 
-                app_->request_event(
-                    VEH_STATUS_SERVICE_ID,
-                    VEH_STATUS_INSTANCE_ID,
-                    VEH_STATUS_EVENT_ID,
-                    { VEH_STATUS_EVENTGROUP_ID },
-                    vsomeip::event_type_e::ET_EVENT,
-                    vsomeip::reliability_type_e::RT_UNRELIABLE);
-                app_->subscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, VEH_STATUS_EVENTGROUP_ID);
+                for_each_status_event(STATUS_EVENT_GROUPS, [this](const StatusEventInfo& info) {
+                    app_->request_event(
+                        VEH_STATUS_SERVICE_ID,
+                        VEH_STATUS_INSTANCE_ID,
+                        info.event,
+                        { info.eventgroup },
+                        vsomeip::event_type_e::ET_EVENT,
+                        vsomeip::reliability_type_e::RT_UNRELIABLE);
+                });
+                for (auto group : STATUS_EVENT_GROUPS)
+                    app_->subscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, group);
             }
         });
 
-        app_->register_message_handler(
-            VEH_STATUS_SERVICE_ID,
-            VEH_STATUS_INSTANCE_ID,
-            VEH_STATUS_EVENT_ID,
-            [this](const std::shared_ptr<vsomeip::message> &msg) {
-                on_event(msg);
-            });
+        for_each_status_event(STATUS_EVENT_GROUPS, [this](const StatusEventInfo& info) {
+            app_->register_message_handler(
+                VEH_STATUS_SERVICE_ID,
+                VEH_STATUS_INSTANCE_ID,
+                info.event,
+                [this](const std::shared_ptr<vsomeip::message> &msg) {
+                    on_event(msg);
+                });
+        });
 
         return true;
     }
@@ -109,18 +117,24 @@ private:
     void on_event(const std::shared_ptr<vsomeip::message>& msg) {
         auto pl = msg->get_payload();
         if (!pl || pl->get_length() < 2) return;
-        auto data = pl->get_data();
-
-        uint8_t type = data[0];
-        std::vector<uint8_t> val(data + 1, data + pl->get_length());
-
-        std::ostringstream oss;
-        oss << "[EVT] TYPE=0x" << std::hex << (int)type << " DATA=[";
-        for (auto b : val) oss << std::setw(2) << std::setfill('0') << (int)b << " ";
-        oss << "]";
-        LOG_INFO(g_logger, oss.str());
 
-        std::cout << oss.str() << std::endl;
+        // 단일 레코드 또는 배치 페이로드의 레코드마다 한 줄
+        bool ok = for_each_status_record(pl->get_data(), pl->get_length(),
+            [](uint8_t type, const uint8_t *val, size_t len, uint64_t rx_time_ns) {
+                std::ostringstream oss;
+                oss << "[EVT] TYPE=0x" << std::hex << (int)type << " DATA=[";
+                for (size_t i = 0; i < len; ++i) oss << std::setw(2) << std::setfill('0') << (int)val[i] << " ";
+                oss << "]";
+                if (rx_time_ns) {  // 서버 rx_timestamp on: CAN 수신 → 여기까지 지연
+                    auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+                    oss << std::dec << " LAT=" << (now_ns - (int64_t)rx_time_ns) / 1000 << "us";
+                }
+                LOG_INFO(g_logger, oss.str());
+
+                std::cout << oss.str() << std::endl;
+            });
+        if (!ok) LOG_WARN(g_logger, "[EVT] Truncated batch payload");
     }
 };
 
@@ -1,5 +1,8 @@
 #pragma once
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <iterator>
 
 // =======================================================
 // veh_status_service — Event/Status (Server → Client)
@@ -7,8 +10,17 @@
 
 #define VEH_STATUS_SERVICE_ID       0x1200
 #define VEH_STATUS_INSTANCE_ID      0x0001
-#define VEH_STATUS_EVENT_ID         0x0200
-#define VEH_STATUS_EVENTGROUP_ID    0x0001
+
+// 이벤트: StatusType마다 하나 (0x0200 + StatusType), 페이로드는 [StatusType][값...]
+#define VEH_STATUS_AEB_EVENT_ID         0x0201
+#define VEH_STATUS_AUTOPARK_EVENT_ID    0x0202
+#define VEH_STATUS_TOF_EVENT_ID         0x0203
+#define VEH_STATUS_AUTH_EVENT_ID        0x0204
+
+// 이벤트그룹: 구독 단위
+#define VEH_STATUS_SAFETY_EVENTGROUP_ID     0x0001  // AEB, 자율주차
+#define VEH_STATUS_SENSORS_EVENTGROUP_ID    0x0002  // ToF 거리
+#define VEH_STATUS_SESSION_EVENTGROUP_ID    0x0003  // 인증
 
 // CAN ID
 #define VEH_STATUS_CAN_ID           0x310
@@ -21,6 +33,92 @@ enum class StatusType : uint8_t {
     AUTH_STATE      = 0x04   // 인증 결과
 };
 
+// 배치 페이로드 (서버 batch_window_us > 0): 창 안에 모인 같은 이벤트의 레코드들
+//   [VEH_STATUS_BATCH_MARKER] { [레코드 길이][StatusType][값...] } × N   (레코드 길이 = 1 + 값 길이)
+// 단일 페이로드 [StatusType][값...]와는 첫 바이트로 구분 (StatusType은 0xFF를 쓰지 않음)
+#define VEH_STATUS_BATCH_MARKER     0xFF
+
+// 수신 시각 트레일러 (서버 rx_timestamp on): StatusType에 플래그를 세우고 값 뒤에
+// 커널 CAN 수신 시각(CLOCK_REALTIME, ns, Big Endian 8바이트)을 붙임. 배치 레코드 길이에 포함
+#define VEH_STATUS_TIMESTAMP_FLAG   0x80
+#define VEH_STATUS_TIMESTAMP_LEN    8
+
+// 단일/배치 페이로드의 레코드마다 fn(type, value, value_len, rx_time_ns) 호출
+// (트레일러가 없으면 rx_time_ns = 0). 잘린 배치면 false
+template <typename Fn>
+inline bool for_each_status_record(const uint8_t* data, size_t length, Fn&& fn) {
+    auto emit = [&fn](const uint8_t* record, size_t record_len) {
+        uint8_t type = record[0];
+        size_t value_len = record_len - 1;
+        uint64_t rx_time_ns = 0;
+        if ((type & VEH_STATUS_TIMESTAMP_FLAG) && value_len >= VEH_STATUS_TIMESTAMP_LEN) {
+            value_len -= VEH_STATUS_TIMESTAMP_LEN;
+            for (size_t i = 0; i < VEH_STATUS_TIMESTAMP_LEN; ++i)
+                rx_time_ns = (rx_time_ns << 8) | record[1 + value_len + i];
+            type &= ~VEH_STATUS_TIMESTAMP_FLAG;
+        }
+        fn(type, record + 1, value_len, rx_time_ns);
+    };
+
+    if (length < 1) return false;
+    if (data[0] != VEH_STATUS_BATCH_MARKER) {
+        emit(data, length);
+        return true;
+    }
+    size_t pos = 1;
+    while (pos < length) {
+        const size_t record_len = data[pos];
+        if (record_len < 1 || pos + 1 + record_len > length) return false;
+        emit(data + pos + 1, record_len);
+        pos += 1 + record_len;
+    }
+    return true;
+}
+
+// StatusType ↔ 이벤트/이벤트그룹 매핑 (서버 offer, 클라이언트 request_event에서 공용)
+struct StatusEventInfo {
+    StatusType type;
+    uint16_t event;
+    uint16_t eventgroup;
+};
+
+inline constexpr StatusEventInfo STATUS_EVENTS[] = {
+    { StatusType::AEB_STATE,      VEH_STATUS_AEB_EVENT_ID,      VEH_STATUS_SAFETY_EVENTGROUP_ID  },
+    { StatusType::AUTOPARK_STATE, VEH_STATUS_AUTOPARK_EVENT_ID, VEH_STATUS_SAFETY_EVENTGROUP_ID  },
+    { StatusType::TOF_DISTANCE,   VEH_STATUS_TOF_EVENT_ID,      VEH_STATUS_SENSORS_EVENTGROUP_ID },
+    { StatusType::AUTH_STATE,     VEH_STATUS_AUTH_EVENT_ID,     VEH_STATUS_SESSION_EVENTGROUP_ID },
+};
+
+// 전체 이벤트그룹 (클라이언트 기본 구독)
+inline constexpr uint16_t STATUS_EVENTGROUPS[] = {
+    VEH_STATUS_SAFETY_EVENTGROUP_ID,
+    VEH_STATUS_SENSORS_EVENTGROUP_ID,
+    VEH_STATUS_SESSION_EVENTGROUP_ID,
+};
+
+// groups(이벤트그룹 ID 목록)에 속한 STATUS_EVENTS 항목마다 fn(info) 호출
+// (클라이언트의 request_event / register_message_handler 공용)
+template <typename Groups, typename Fn>
+inline void for_each_status_event(const Groups& groups, Fn&& fn) {
+    for (const StatusEventInfo& info : STATUS_EVENTS) {
+        if (std::find(std::begin(groups), std::end(groups), info.eventgroup) != std::end(groups))
+            fn(info);
+    }
+}
+
+// 상태 타입이 발행될 이벤트 ID (0 = 알 수 없는 타입)
+inline uint16_t status_event_id(uint8_t status_type) {
+    for (const StatusEventInfo& info : STATUS_EVENTS)
+        if (static_cast<uint8_t>(info.type) == status_type) return info.event;
+    return 0;
+}
+
+// 상태 프레임 [StatusType][값...]에서 값 길이가 고정된 타입 (0 = 프레임 끝까지)
+// ToF 거리(0x03)는 3바이트 값 (예: 03 00 02 28 → 0x0228 = 552mm)
+inline uint8_t status_value_length(uint8_t status_type) {
+    return status_type == static_cast<uint8_t>(StatusType::TOF_DISTANCE) ? 3 : 0;
+}
+
 // 데이터 구조 (고정 8B 예시용)
 struct StatusPayload {
     uint8_t status_type;
@@ -8,6 +8,9 @@
 
 using namespace std::chrono_literals;
 
+// GUI가 표시하는 상태: AEB/자율주차(safety), ToF(sensors), 인증(session) → 전체 이벤트그룹
+static constexpr const auto &kStatusEventGroups = STATUS_EVENTGROUPS;
+
 VsClientThread::VsClientThread(QObject *parent)
     : QThread(parent)
 {
@@ -48,26 +51,31 @@ void VsClientThread::init_vsomeip() {
             app_->request_service(VEH_CONTROL_SERVICE_ID, VEH_CONTROL_INSTANCE_ID);
             app_->request_service(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID);
 
-            app_->request_event(
-                VEH_STATUS_SERVICE_ID,
-                VEH_STATUS_INSTANCE_ID,
-                VEH_STATUS_EVENT_ID,
-                { VEH_STATUS_EVENTGROUP_ID },
-                vsomeip::event_type_e::ET_EVENT,
-                vsomeip::reliability_type_e::RT_UNRELIABLE);
-
-            app_->subscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, VEH_STATUS_EVENTGROUP_ID);
+            // StatusType별 이벤트 중 필요한 그룹 것만 등록/구독
+            for_each_status_event(kStatusEventGroups, [this](const StatusEventInfo &info) {
+                app_->request_event(
+                    VEH_STATUS_SERVICE_ID,
+                    VEH_STATUS_INSTANCE_ID,
+                    info.event,
+                    { info.eventgroup },
+                    vsomeip::event_type_e::ET_EVENT,
+                    vsomeip::reliability_type_e::RT_UNRELIABLE);
+            });
+            for (auto group : kStatusEventGroups)
+                app_->subscribe(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, group);
         }
     });
 
     // 이벤트 핸들러: 상태 수신 시 파싱 후 GUI로 시그널
-    app_->register_message_handler(
-        VEH_STATUS_SERVICE_ID,
-        VEH_STATUS_INSTANCE_ID,
-        VEH_STATUS_EVENT_ID,
-        [this](const std::shared_ptr<vsomeip::message> &msg) {
-            onEvent(msg);
-        });
+    for_each_status_event(kStatusEventGroups, [this](const StatusEventInfo &info) {
+        app_->register_message_handler(
+            VEH_STATUS_SERVICE_ID,
+            VEH_STATUS_INSTANCE_ID,
+            info.event,
+            [this](const std::shared_ptr<vsomeip::message> &msg) {
+                onEvent(msg);
+            });
+    });
 }
 
 void VsClientThread::start_vsomeip() {
@@ -89,46 +97,64 @@ void VsClientThread::stop_vsomeip() {
 void VsClientThread::onEvent(const std::shared_ptr<vsomeip::message> &msg) {
     auto pl = msg->get_payload();
     if (!pl || pl->get_length() < 2) return;
-    const auto *data = pl->get_data();
-    uint8_t type = data[0];
+
+    // 단일 레코드 또는 배치 페이로드 (서버 batch_window_us)
+    bool ok = for_each_status_record(pl->get_data(), pl->get_length(),
+        [this](uint8_t type, const uint8_t *val, size_t len, uint64_t rx_time_ns) {
+            onRecord(type, val, len, rx_time_ns);
+        });
+    if (!ok)
+        emit logLine("[WARN] Truncated status batch");
+}
+
+void VsClientThread::onRecord(uint8_t type, const uint8_t *val, size_t len, uint64_t rx_time_ns) {
+    // 서버 rx_timestamp on: 커널 CAN 수신 시각 → 이 스레드 수신까지 지연 (서버/클라이언트 시계 동기 전제)
+    qint64 latency_us = -1;
+    if (rx_time_ns) {
+        auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        latency_us = (now_ns - static_cast<qint64>(rx_time_ns)) / 1000;
+        emit statusLatency(type, static_cast<quint64>(rx_time_ns), latency_us);
+    }
 
     // 로깅
     {
         std::ostringstream oss;
         oss << "[EVT] TYPE=0x" << std::hex << (int)type << " DATA=[";
-        for (size_t i=1; i<pl->get_length(); ++i) {
-            oss << std::setw(2) << std::setfill('0') << std::hex << (int)data[i] << " ";
+        for (size_t i=0; i<len; ++i) {
+            oss << std::setw(2) << std::setfill('0') << std::hex << (int)val[i] << " ";
         }
         oss << "]";
+        if (latency_us >= 0) oss << std::dec << " LAT=" << latency_us << "us";
         emit logLine(QString::fromStdString(oss.str()));
     }
 
     switch (static_cast<StatusType>(type)) {
         case StatusType::AEB_STATE: {
-            if (pl->get_length() >= 2) {
-                bool active = data[1] != 0x00;
+            if (len >= 1) {
+                bool active = val[0] != 0x00;
                 emit aebStateChanged(active);
             }
             break;
         }
         case StatusType::AUTOPARK_STATE: {
-            if (pl->get_length() >= 2) {
-                emit autoparkStateChanged(data[1]);
+            if (len >= 1) {
+                emit autoparkStateChanged(val[0]);
             }
             break;
         }
         case StatusType::TOF_DISTANCE: {
-            if (pl->get_length() >= 4) {
-                uint32_t mm = (static_cast<uint32_t>(data[1]) << 16) |
-                            (static_cast<uint32_t>(data[2]) << 8)  |
-                            (static_cast<uint32_t>(data[3]));
+            if (len >= 3) {
+                uint32_t mm = (static_cast<uint32_t>(val[0]) << 16) |
+                            (static_cast<uint32_t>(val[1]) << 8)  |
+                            (static_cast<uint32_t>(val[2]));
                 emit tofChanged(mm);
             }
             break;
         }
         case StatusType::AUTH_STATE: {
-            if (pl->get_length() >= 2) {
-                bool ok = data[1] != 0x00;
+            if (len >= 1) {
+                bool ok = val[0] != 0x00;
                 emit authStateChanged(ok);
             }
             break;
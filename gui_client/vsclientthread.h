@@ -31,6 +31,8 @@ signals:
     void autoparkStateChanged(uint8_t state);
     void tofChanged(uint32_t mm);
     void authStateChanged(bool ok);
+    // 서버가 CAN 수신 시각을 실어 보낸 경우 (rx_timestamp on): 수신 시각(ns, epoch)과 화면까지 지연(us)
+    void statusLatency(uint8_t type, quint64 rxTimeNs, qint64 latencyUs);
 
     void logLine(QString line); // 상태/로그 출력용(선택)
 
@@ -43,6 +45,7 @@ private:
     void stop_vsomeip();
 
     void onEvent(const std::shared_ptr<vsomeip::message> &msg);
+    void onRecord(uint8_t type, const uint8_t *val, size_t len, uint64_t rx_time_ns);   // 상태 레코드 하나
     void sendCommand(uint8_t cmdType, const std::vector<uint8_t> &val);
 
 private:
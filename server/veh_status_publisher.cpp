@@ -24,8 +24,6 @@ using namespace std::chrono_literals;
 namespace {
 constexpr vsomeip::service_t  SERVICE_ID  = VEH_STATUS_SERVICE_ID;
 constexpr vsomeip::instance_t INSTANCE_ID = VEH_STATUS_INSTANCE_ID;
-constexpr vsomeip::event_t    EVENT_ID    = VEH_STATUS_EVENT_ID;
-constexpr vsomeip::eventgroup_t EVENT_GROUP = VEH_STATUS_EVENTGROUP_ID;
 
 std::atomic<bool> g_running{true};
 void on_signal(int) { g_running = false; }
@@ -56,12 +54,14 @@ private:
     void on_state(vsomeip::state_type_e state) {
         if (state == vsomeip::state_type_e::ST_REGISTERED) {
             app_->offer_service(SERVICE_ID, INSTANCE_ID);
-            app_->offer_event(
-                SERVICE_ID, INSTANCE_ID, EVENT_ID,
-                {EVENT_GROUP},
-                vsomeip::event_type_e::ET_EVENT,
-                std::chrono::milliseconds::zero(),
-                false, true);
+            for (const StatusEventInfo& info : STATUS_EVENTS) {
+                app_->offer_event(
+                    SERVICE_ID, INSTANCE_ID, info.event,
+                    {info.eventgroup},
+                    vsomeip::event_type_e::ET_EVENT,
+                    std::chrono::milliseconds::zero(),
+                    false, true);
+            }
 
             pub_thread_ = std::thread(&VehStatusPublisher::publish_loop, this);
         }
@@ -78,8 +78,11 @@ private:
     }
 
     void publish_once(uint8_t type, const std::vector<uint8_t>& val) {
+        const vsomeip::event_t event = status_event_id(type);
+        if (!event) return;   // 이벤트가 없는 상태 타입
+
         auto payload = make_payload(type, val);
-        app_->notify(SERVICE_ID, INSTANCE_ID, EVENT_ID, payload);
+        app_->notify(SERVICE_ID, INSTANCE_ID, event, payload);
 
         std::ostringstream oss;
         oss << "[CAN→SOME/IP] Notify: type=0x"
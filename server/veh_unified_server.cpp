@@ -1,18 +1,32 @@
 #include <vsomeip/vsomeip.hpp>
 #include <thread>
 #include <chrono>
-#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <sstream>
 #include <iomanip>
 #include <cstring>
+#include <cerrno>
+#include <array>
+#include <atomic>
+#include <fstream>
 #include <iostream>
 #include <signal.h>
-#include <poll.h>
+#include <fcntl.h>
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
 #include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "veh_logger.hpp"
@@ -22,17 +36,433 @@
 using namespace std::chrono_literals;
 
 /* ──────────────────────────────────────────────────────────────
- *  Global logger & signal handler
+ *  Global logger
  * ────────────────────────────────────────────────────────────── */
 veh::Logger g_logger("logs/veh_unified_server.log");
-std::atomic<bool> g_running{true};
 
-/* SIGINT(SIGTERM) 수신 시 플래그를 내려 서버를 안전하게 종료 */
-void on_signal(int) { 
-    std::cout << "\n[INFO] SIGINT received. Graceful shutdown..." << std::endl;
-    g_running = false; 
+constexpr auto CAN_REOPEN_DELAY = 1000ms; // CAN 인터페이스가 내려갔을 때 다시 열어 보는 간격
+constexpr size_t CAN_RX_RING_SLOTS = 4096;  // CAN 수신 스레드 → 발행(메인) 스레드 링 크기 (약 100KB)
+constexpr auto CAN_OVERFLOW_REPORT_INTERVAL = 1000ms; // 수신 오버플로 경고 로그 최소 간격
+
+/* 상태 이벤트 배치: 창(window) 동안 같은 이벤트의 레코드를 모아 notify 한 번으로 보냄 */
+constexpr size_t STATUS_BATCH_MAX_BYTES = 1400;  // 이더넷 MTU 1500 - IP/UDP/SOME/IP 헤더
+constexpr size_t STATUS_BATCH_MIN_BYTES = 1 + 2 + CAN_MAX_DLEN + VEH_STATUS_TIMESTAMP_LEN;  // 마커 + 최대 레코드 하나
+
+struct StatusPublishConfig {
+    std::chrono::microseconds batch_window{0};  // 0 = 배치 안 함 (레코드마다 notify)
+    size_t batch_max_bytes = STATUS_BATCH_MAX_BYTES;
+    bool rx_timestamp = false;                   // 레코드 뒤에 커널 CAN 수신 시각 트레일러
+};
+
+/* ──────────────────────────────────────────────────────────────
+ *  CAN 수신 라우팅 테이블
+ *  - 설정 파일 한 줄이 CAN ID/마스크 하나를 디코더 + SOME/IP 이벤트에 연결
+ *      route <CAN ID>[/<마스크>] decoder=<status|raw> [type=<StatusType>] [event=<이벤트 ID>]
+ *    status: [StatusType][값...] 형식 (0x310), raw: 프레임 전체가 값이고 type=으로 StatusType 지정
+ *    이벤트는 생략하면 StatusType별 이벤트 (veh_status_service.hpp STATUS_EVENTS)
+ *  - 모든 항목을 CAN_RAW_FILTER 배열 하나로 커널에 걸어 나머지 프레임은 커널에서 버림
+ *  - 11비트 ID는 2048칸 배열로 바로 찾고, 29비트 ID만 해시/목록에서 찾음
+ * ────────────────────────────────────────────────────────────── */
+struct StatusRecord {
+    uint8_t type = 0;
+    uint16_t event = 0;
+    std::vector<uint8_t> value;
+    uint64_t rx_time_ns = 0;  // 커널 CAN 수신 시각 (CLOCK_REALTIME)
+};
+
+struct CanRoute;
+using CanDecoder = bool (*)(const can_frame& frame, const CanRoute& route, StatusRecord& out);
+
+struct CanRoute {
+    uint32_t can_id = 0;   // 29비트 ID면 CAN_EFF_FLAG 포함
+    uint32_t mask = CAN_SFF_MASK;
+    CanDecoder decoder = nullptr;
+    uint8_t type = 0;      // raw 디코더가 붙일 StatusType
+    uint16_t event = 0;    // 0 = StatusType별 이벤트
+};
+
+/* [StatusType][값...]: 타입별 고정 길이가 있으면 그만큼만 (프레임이 짧으면 끝까지)
+ * StatusType의 최상위 비트는 페이로드의 수신 시각 플래그라 0x80 이상은 버림 */
+static bool decode_status(const can_frame& frame, const CanRoute& route, StatusRecord& out) {
+    if (frame.can_dlc < 2 || (frame.data[0] & VEH_STATUS_TIMESTAMP_FLAG)) return false;
+    out.type = frame.data[0];
+    size_t len = status_value_length(out.type);
+    size_t end = (len > 0 && frame.can_dlc >= 1 + len) ? 1 + len : frame.can_dlc;
+    out.value.assign(frame.data + 1, frame.data + end);
+    out.event = route.event ? route.event : status_event_id(out.type);
+    return true;
+}
+
+/* 전용 CAN ID 메시지: 프레임 전체가 값 */
+static bool decode_raw(const can_frame& frame, const CanRoute& route, StatusRecord& out) {
+    if (frame.can_dlc < 1) return false;
+    out.type = route.type;
+    out.value.assign(frame.data, frame.data + frame.can_dlc);
+    out.event = route.event ? route.event : status_event_id(out.type);
+    return true;
 }
 
+class CanRouteTable {
+public:
+    /* 설정 파일이 없을 때: 기본 상태 프레임(0x310) 하나만 라우팅 */
+    void add_default() {
+        add(CanRoute{ VEH_STATUS_CAN_ID, CAN_SFF_MASK, decode_status, 0, 0 });
+    }
+
+    /* "route" 뒤의 나머지 토큰. 잘못된 항목은 std::invalid_argument */
+    void parse_route(std::istringstream& tokens) {
+        std::string id_text;
+        if (!(tokens >> id_text)) throw std::invalid_argument("CAN ID 누락");
+        CanRoute route;
+        size_t slash = id_text.find('/');
+        route.can_id = std::stoul(id_text.substr(0, slash), nullptr, 0);
+        bool eff = route.can_id > CAN_SFF_MASK;
+        route.mask = (slash == std::string::npos) ? (eff ? CAN_EFF_MASK : CAN_SFF_MASK)
+                                                  : std::stoul(id_text.substr(slash + 1), nullptr, 0);
+        if (route.can_id > CAN_EFF_MASK) throw std::invalid_argument("CAN ID 범위 초과: " + id_text);
+        if (eff) route.can_id |= CAN_EFF_FLAG;
+
+        std::string option;
+        while (tokens >> option) {
+            size_t eq = option.find('=');
+            if (eq == std::string::npos) throw std::invalid_argument(option);
+            std::string name  = option.substr(0, eq);
+            std::string value = option.substr(eq + 1);
+            if (name == "decoder" && value == "status") route.decoder = decode_status;
+            else if (name == "decoder" && value == "raw") route.decoder = decode_raw;
+            else if (name == "type") {
+                unsigned long type = std::stoul(value, nullptr, 0);
+                if (type & ~0x7FUL) throw std::invalid_argument("type 범위: 0x00~0x7F");
+                route.type = type;
+            }
+            else if (name == "event") route.event = std::stoul(value, nullptr, 0);
+            else throw std::invalid_argument(option);
+        }
+        if (!route.decoder) throw std::invalid_argument("decoder 누락");
+        if (route.decoder == decode_raw && !route.event && !status_event_id(route.type))
+            throw std::invalid_argument("raw 디코더에 알 수 없는 type");
+        if (route.event && !is_offered_event(route.event))
+            throw std::invalid_argument("제공하지 않는 이벤트: " + std::to_string(route.event));
+        if (routes_.size() >= MAX_ROUTES) throw std::invalid_argument("항목이 너무 많음");
+        add(route);
+    }
+
+    /* 커널 필터 배열 (11비트 항목은 EFF 플래그까지 비교해 같은 하위 비트의 29비트 프레임을 거름) */
+    std::vector<can_filter> filters() const {
+        std::vector<can_filter> out;
+        for (const CanRoute& r : routes_)
+            out.push_back(can_filter{ r.can_id, r.mask | CAN_EFF_FLAG | CAN_RTR_FLAG });
+        return out;
+    }
+
+    const CanRoute* find(uint32_t can_id) const {
+        if (!(can_id & CAN_EFF_FLAG)) {
+            int16_t index = sff_index_[can_id & CAN_SFF_MASK];
+            return index < 0 ? nullptr : &routes_[index];
+        }
+        auto it = eff_exact_.find(can_id);
+        if (it != eff_exact_.end()) return &routes_[it->second];
+        for (int16_t index : eff_masked_) {
+            const CanRoute& r = routes_[index];
+            if (((can_id ^ r.can_id) & r.mask & CAN_EFF_MASK) == 0) return &r;
+        }
+        return nullptr;
+    }
+
+    size_t size() const { return routes_.size(); }
+
+private:
+    static constexpr size_t MAX_ROUTES = 512;
+
+    static bool is_offered_event(uint16_t event) {
+        for (const StatusEventInfo& info : STATUS_EVENTS)
+            if (info.event == event) return true;
+        return false;
+    }
+
+    std::vector<CanRoute> routes_;
+    std::array<int16_t, CAN_SFF_MASK + 1> sff_index_ = make_empty_index();
+    std::unordered_map<uint32_t, int16_t> eff_exact_;
+    std::vector<int16_t> eff_masked_;
+
+    static std::array<int16_t, CAN_SFF_MASK + 1> make_empty_index() {
+        std::array<int16_t, CAN_SFF_MASK + 1> index;
+        index.fill(-1);
+        return index;
+    }
+
+    /* 11비트 항목은 마스크에 맞는 모든 ID 칸에 미리 펼쳐 둠 (먼저 적은 항목 우선) */
+    void add(const CanRoute& route) {
+        int16_t index = static_cast<int16_t>(routes_.size());
+        routes_.push_back(route);
+        if (!(route.can_id & CAN_EFF_FLAG)) {
+            for (uint32_t id = 0; id <= CAN_SFF_MASK; ++id) {
+                if (((id ^ route.can_id) & route.mask & CAN_SFF_MASK) == 0 && sff_index_[id] < 0)
+                    sff_index_[id] = index;
+            }
+        }
+        else if ((route.mask & CAN_EFF_MASK) == CAN_EFF_MASK) {
+            eff_exact_.emplace(route.can_id, index);
+        }
+        else {
+            eff_masked_.push_back(index);
+        }
+    }
+};
+
+/* 서버 설정 파일: route 줄 + 이벤트 배치 설정 (resources/veh_can_routes.conf)
+ * path가 없거나 route 줄이 없으면 기본 라우팅, 배치 설정이 없으면 배치 없음 */
+static bool load_server_config(const char* path, CanRouteTable& routes, StatusPublishConfig& cfg) {
+    if (!path) {
+        routes.add_default();
+        return true;
+    }
+
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "[CONFIG] Cannot open " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        ++line_no;
+        line = line.substr(0, line.find('#'));
+        std::istringstream tokens(line);
+        std::string key, value;
+        if (!(tokens >> key)) continue;
+        try {
+            if (key == "route") {
+                routes.parse_route(tokens);
+            }
+            else if (key == "batch_window_us" && tokens >> value) {
+                cfg.batch_window = std::chrono::microseconds(std::stoul(value, nullptr, 0));
+            }
+            else if (key == "batch_max_bytes" && tokens >> value) {
+                cfg.batch_max_bytes = std::stoul(value, nullptr, 0);
+                if (cfg.batch_max_bytes < STATUS_BATCH_MIN_BYTES || cfg.batch_max_bytes > STATUS_BATCH_MAX_BYTES)
+                    throw std::invalid_argument("batch_max_bytes 범위: " + std::to_string(STATUS_BATCH_MIN_BYTES) +
+                                                "~" + std::to_string(STATUS_BATCH_MAX_BYTES));
+            }
+            else if (key == "rx_timestamp" && tokens >> value) {
+                if (value != "on" && value != "off") throw std::invalid_argument("rx_timestamp on|off");
+                cfg.rx_timestamp = value == "on";
+            }
+            else {
+                throw std::invalid_argument(key);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "[CONFIG] " << path << ":" << line_no << ": " << e.what() << std::endl;
+            return false;
+        }
+    }
+    if (routes.size() == 0) routes.add_default(); // 배치 설정만 있는 파일
+    return true;
+}
+
+/* ──────────────────────────────────────────────────────────────
+ *  단일 생산자/단일 소비자 링 (락 없음)
+ *  - 생산자(CAN 수신 스레드)만 head_, 소비자(메인 스레드)만 tail_을 씀
+ *  - 두 인덱스를 서로 다른 캐시 라인에 두고, 상대 인덱스는 가득/빔으로 보일 때만 다시 읽음
+ *  - 가득 차면 새 항목을 버리고 overflows()를 올림 (수신 스레드는 절대 기다리지 않음)
+ * ────────────────────────────────────────────────────────────── */
+template <typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    static constexpr size_t CACHE_LINE = 64;
+
+public:
+    bool push(const T& item) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ == Capacity) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ == Capacity) {
+                overflows_.store(overflows_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        slots_[head & (Capacity - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& out) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail == head_cache_) return false;
+        }
+        out = slots_[tail & (Capacity - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+    /* 생산자 캐시 라인 */
+    alignas(CACHE_LINE) std::atomic<size_t> head_{0};
+    size_t tail_cache_ = 0;
+    std::atomic<uint64_t> overflows_{0};
+    /* 소비자 캐시 라인 */
+    alignas(CACHE_LINE) std::atomic<size_t> tail_{0};
+    size_t head_cache_ = 0;
+
+    alignas(CACHE_LINE) std::array<T, Capacity> slots_{};
+};
+
+/* 수신 스레드가 링에 넣는 원본 프레임 (디코딩은 발행 쪽에서) */
+struct CanRxSlot {
+    can_frame frame;
+    uint64_t rx_time_ns;  // 커널 CAN 수신 시각 (CLOCK_REALTIME)
+};
+
+/* ──────────────────────────────────────────────────────────────
+ *  Reactor (epoll + signalfd + timerfd + eventfd)
+ *  - 메인 스레드 하나에서 CAN 수신, 종료 시그널, 타이머, vsomeip 스레드가 넘긴 작업을 처리
+ *  - 할 일이 없으면 epoll_wait(-1)에서 잠들므로 유휴 상태에서 주기적으로 깨어나지 않음
+ *  - post()/stop()만 다른 스레드에서 호출 가능 (eventfd로 깨움)
+ * ────────────────────────────────────────────────────────────── */
+class Reactor {
+public:
+    using Handler = std::function<void()>;
+
+    ~Reactor() {
+        for (int fd : owned_fds_) close(fd);
+        if (wake_fd_ >= 0) close(wake_fd_);
+        if (epoll_fd_ >= 0) close(epoll_fd_);
+    }
+
+    bool init() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd_  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ < 0 || wake_fd_ < 0) return false;
+        return add(wake_fd_, [this]() { run_posted(); });
+    }
+
+    /* fd가 읽기 가능해지면 handler 호출 (fd는 호출자가 소유) */
+    bool add(int fd, Handler handler) {
+        epoll_event ev{};
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) return false;
+        handlers_[fd] = std::make_shared<Handler>(std::move(handler));
+        return true;
+    }
+
+    void remove(int fd) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        handlers_.erase(fd);
+    }
+
+    /* 지정한 시그널을 signalfd로 받음 (모든 스레드에서 미리 block 되어 있어야 함) */
+    bool add_signals(const sigset_t& mask, std::function<void(int)> handler) {
+        int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd < 0) return false;
+        owned_fds_.push_back(fd);
+        return add(fd, [fd, handler = std::move(handler)]() {
+            signalfd_siginfo info;
+            while (read(fd, &info, sizeof(info)) == sizeof(info))
+                handler(static_cast<int>(info.ssi_signo));
+        });
+    }
+
+    /* delay 뒤 한 번 (period > 0이면 그 주기로 반복) 실행되는 timerfd. 반환값은 cancel_timer()용 */
+    int add_timer(std::chrono::microseconds delay, std::chrono::microseconds period, Handler handler) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) return -1;
+        itimerspec its{};
+        its.it_value    = to_timespec(delay.count() > 0 ? delay : 1ms); // 0은 타이머 해제를 뜻하므로 피함
+        its.it_interval = to_timespec(period);
+        bool once = period.count() == 0;
+        if (timerfd_settime(fd, 0, &its, nullptr) < 0 ||
+            !add(fd, [this, fd, once, handler = std::move(handler)]() {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+                if (once) {
+                    Handler h = handler; // remove()가 이 람다를 지우므로 먼저 복사
+                    remove(fd);
+                    close(fd);
+                    h();
+                    return;
+                }
+                handler();
+            })) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /* 해제 후 fd를 -1로 돌려놓아 "타이머 없음" 상태를 표시 */
+    void cancel_timer(int& fd) {
+        if (fd < 0) return;
+        remove(fd);
+        close(fd);
+        fd = -1;
+    }
+
+    /* 다른 스레드(vsomeip 핸들러 등)에서 리액터 스레드로 작업을 넘김 */
+    void post(Handler task) {
+        {
+            std::lock_guard<std::mutex> g(post_mutex_);
+            posted_.push_back(std::move(task));
+        }
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+
+    void stop() { post([this]() { running_ = false; }); }
+
+    void run() {
+        epoll_event events[16];
+        running_ = true;
+        while (running_) {
+            int n = epoll_wait(epoll_fd_, events, 16, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < n && running_; ++i) {
+                auto it = handlers_.find(events[i].data.fd);
+                if (it == handlers_.end()) continue; // 같은 배치 안에서 이미 제거된 fd
+                std::shared_ptr<Handler> handler = it->second;
+                (*handler)();
+            }
+        }
+    }
+
+private:
+    int epoll_fd_ = -1;
+    int wake_fd_  = -1;
+    bool running_ = false;
+    std::unordered_map<int, std::shared_ptr<Handler>> handlers_;
+    std::vector<int> owned_fds_;
+    std::mutex post_mutex_;
+    std::vector<Handler> posted_;
+
+    void run_posted() {
+        uint64_t count;
+        while (read(wake_fd_, &count, sizeof(count)) > 0) {}
+        std::vector<Handler> tasks;
+        {
+            std::lock_guard<std::mutex> g(post_mutex_);
+            tasks.swap(posted_);
+        }
+        for (auto& task : tasks) task();
+    }
+
+    static timespec to_timespec(std::chrono::microseconds us) {
+        timespec ts{};
+        ts.tv_sec  = us.count() / 1000000;
+        ts.tv_nsec = (us.count() % 1000000) * 1000;
+        return ts;
+    }
+};
+
 /* ──────────────────────────────────────────────────────────────
  *  Unified Server Class (SOME/IP + CAN Bridge)
  *  - 역할: vsomeip 요청 수신 → CAN 송신
@@ -44,7 +474,28 @@ public:
     : app_(vsomeip::runtime::get()->create_application("veh_unified_server")) {}
 
     /* ─────────────── 초기화 ─────────────── */
-    bool init() {
+    /* SIGINT/SIGTERM은 main()에서 미리 block 해 두고 여기서 signalfd로 받음 */
+    bool init(const sigset_t& stop_signals, const char* config_path) {
+        if (!load_server_config(config_path, routes_, publish_cfg_)) {
+            LOG_ERROR(g_logger, "Server config load failed");
+            return false;
+        }
+        LOG_INFO(g_logger, "[ROUTE] " + std::to_string(routes_.size()) + " CAN route(s) loaded");
+        if (publish_cfg_.rx_timestamp)
+            LOG_INFO(g_logger, "[EVT] CAN RX timestamp trailer enabled");
+        if (publish_cfg_.batch_window.count() > 0)
+            LOG_INFO(g_logger, "[EVT] Batching " + std::to_string(publish_cfg_.batch_window.count()) + "us / " +
+                               std::to_string(publish_cfg_.batch_max_bytes) + " bytes");
+
+        if (!reactor_.init() || !rx_reactor_.init()) {
+            LOG_ERROR(g_logger, "epoll/eventfd create failed");
+            return false;
+        }
+        reactor_.add_signals(stop_signals, [this](int signo) {
+            LOG_INFO(g_logger, std::string(signo == SIGINT ? "SIGINT" : "SIGTERM") + " received. Graceful shutdown...");
+            reactor_.stop();
+        });
+
         /* vsomeip 초기화 */
         if (!app_->init()) {
             LOG_ERROR(g_logger, "vsomeip init failed");
@@ -57,13 +508,13 @@ public:
                 offer_services(); // 등록 완료 후 서비스 제공
         });
 
-        /* 제어 요청 메시지 핸들러 등록 */
+        /* 제어 요청 메시지 핸들러 등록 (CAN 송신과 로그는 리액터 스레드에서 처리) */
         app_->register_message_handler(
             VEH_CONTROL_SERVICE_ID,
             VEH_CONTROL_INSTANCE_ID,
             VEH_CONTROL_METHOD_ID,
             [this](const std::shared_ptr<vsomeip::message> &req) {
-                on_control_request(req);
+                reactor_.post([this, req]() { on_control_request(req); });
             });
 
         /* CAN 송신 소켓 열기 */
@@ -73,6 +524,15 @@ public:
             return false;
         }
 
+        /* 수신 스레드 → 메인 스레드 알림 (링에 프레임을 넣은 뒤 묶음마다 한 번) */
+        can_ring_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (can_ring_fd_ < 0 || !reactor_.add(can_ring_fd_, [this]() { drain_can_ring(); })) {
+            LOG_ERROR(g_logger, "CAN RX ring eventfd create failed");
+            return false;
+        }
+
+        /* CAN 수신 소켓 (실패해도 수신 리액터가 주기적으로 다시 시도) */
+        open_can_rx();
         return true;
     }
 
@@ -80,13 +540,11 @@ public:
     void start() {
         LOG_INFO(g_logger, "Starting veh_unified_server...");
 
-        /* vsomeip 런타임과 CAN 리스너를 각각 별도 스레드로 실행 */
+        /* vsomeip 런타임은 별도 스레드, CAN 수신은 수신 스레드(읽기 + 타임스탬프 + 링 push만),
+         * 디코딩/발행/로그와 제어 요청/시그널은 메인 스레드의 리액터에서 처리 */
         vsomeip_thread_ = std::thread([&]() { app_->start(); });
-        can_rx_thread_  = std::thread([&]() { can_listener_loop(); });
-
-        /* 메인 루프는 SIGINT 감시만 수행 */
-        while (g_running)
-            std::this_thread::sleep_for(200ms);
+        can_rx_thread_  = std::thread([this]() { rx_reactor_.run(); });
+        reactor_.run();  // SIGINT/SIGTERM을 받으면 바로 반환
 
         shutdown();  // 종료 시 안전하게 정리
     }
@@ -95,16 +553,20 @@ public:
     void shutdown() {
         LOG_INFO(g_logger, "Shutting down services...");
 
-        /* vsomeip 서비스 중단 */
-        app_->stop_offer_service(VEH_CONTROL_SERVICE_ID, VEH_CONTROL_INSTANCE_ID);
-        app_->stop_offer_service(VEH_STATUS_SERVICE_ID,  VEH_STATUS_INSTANCE_ID);
-
-        /* CAN 수신 스레드 종료 */
-        g_running = false;
+        /* CAN 수신 스레드 종료 후 링에 남은 프레임 발행 */
+        rx_reactor_.stop();
         if (can_rx_thread_.joinable()) {
-            LOG_INFO(g_logger, "Waiting for CAN thread...");
             can_rx_thread_.join();
         }
+        drain_can_ring();
+
+        /* 모으는 중인 상태 배치 전송 */
+        for (auto& [event, batch] : batches_)
+            flush_batch(event, batch);
+
+        /* vsomeip 서비스 중단 */
+        app_->stop_offer_service(VEH_CONTROL_SERVICE_ID, VEH_CONTROL_INSTANCE_ID);
+        app_->stop_offer_service(VEH_STATUS_SERVICE_ID,  VEH_STATUS_INSTANCE_ID);
 
         /* vsomeip 종료 */
         LOG_INFO(g_logger, "Stopping vsomeip app...");
@@ -113,7 +575,14 @@ public:
             vsomeip_thread_.join();
         }
 
-        /* CAN 송신 소켓 닫기 */
+        /* CAN 소켓 닫기 (수신 스레드가 끝났으므로 여기서 정리) */
+        rx_reactor_.cancel_timer(can_reopen_timer_);
+        close_can_rx();
+        if (can_ring_fd_ >= 0) {
+            reactor_.remove(can_ring_fd_);
+            close(can_ring_fd_);
+            can_ring_fd_ = -1;
+        }
         if (can_tx_fd_ >= 0) {
             close(can_tx_fd_);
             can_tx_fd_ = -1;
@@ -126,9 +595,32 @@ private:
     /* ─────────────── 멤버 변수 ─────────────── */
     std::shared_ptr<vsomeip::application> app_;
     std::thread vsomeip_thread_;  // vsomeip 실행 스레드
-    std::thread can_rx_thread_;   // CAN 수신 스레드
+    Reactor reactor_;             // 메인 스레드 이벤트 루프 (디코딩/발행/제어 요청)
     int can_tx_fd_ = -1;          // CAN 송신 소켓
-    int can_rx_fd_ = -1;          // CAN 수신 소켓
+    CanRouteTable routes_;        // CAN ID → 디코더 + 이벤트 (init 후 읽기 전용)
+    StatusRecord record_;         // 디코딩 버퍼 (메인 스레드 전용, 매 프레임 재사용)
+
+    /* CAN 수신 스레드 전용 (can_rx_fd_, can_reopen_timer_는 이 스레드의 리액터에서만 다룸) */
+    std::thread can_rx_thread_;
+    Reactor rx_reactor_;
+    int can_rx_fd_ = -1;          // CAN 수신 소켓 (논블로킹, 수신 리액터에 등록)
+    int can_reopen_timer_ = -1;   // CAN 수신 소켓 재시도 타이머
+
+    /* 수신 스레드 → 메인 스레드 */
+    SpscRing<CanRxSlot, CAN_RX_RING_SLOTS> can_ring_;
+    int can_ring_fd_ = -1;                      // 링에 프레임이 들어왔음을 알리는 eventfd
+    std::atomic<uint32_t> can_kernel_drops_{0}; // 소켓 수신 큐 오버플로 누계 (SO_RXQ_OVFL)
+    uint64_t reported_ring_overflows_ = 0;
+    uint32_t reported_kernel_drops_ = 0;
+    std::chrono::steady_clock::time_point last_overflow_report_{};
+
+    /* 이벤트별로 모으는 중인 배치 페이로드 ([마커][길이][타입][값]...) */
+    struct StatusBatch {
+        std::vector<uint8_t> data;
+        int timer = -1;           // 창 마감 타이머
+    };
+    StatusPublishConfig publish_cfg_;
+    std::unordered_map<uint16_t, StatusBatch> batches_;
 
     /* ─────────────── 서비스 제공 등록 ─────────────── */
     void offer_services() {
@@ -137,19 +629,21 @@ private:
         // ① 제어 서비스 제공
         app_->offer_service(VEH_CONTROL_SERVICE_ID, VEH_CONTROL_INSTANCE_ID);
 
-        // ② 상태 이벤트 서비스 제공
+        // ② 상태 이벤트 서비스 제공 (StatusType별 이벤트, 구독은 이벤트그룹 단위)
         app_->offer_service(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID);
-        app_->offer_event(
-            VEH_STATUS_SERVICE_ID,
-            VEH_STATUS_INSTANCE_ID,
-            VEH_STATUS_EVENT_ID,
-            { VEH_STATUS_EVENTGROUP_ID },
-            vsomeip::event_type_e::ET_EVENT,
-            std::chrono::milliseconds::zero(),
-            false, true);
+        for (const StatusEventInfo& info : STATUS_EVENTS) {
+            app_->offer_event(
+                VEH_STATUS_SERVICE_ID,
+                VEH_STATUS_INSTANCE_ID,
+                info.event,
+                { info.eventgroup },
+                vsomeip::event_type_e::ET_EVENT,
+                std::chrono::milliseconds::zero(),
+                false, true);
+        }
     }
 
-    /* ─────────────── 제어 요청 수신 (vsomeip → CAN) ─────────────── */
+    /* ─────────────── 제어 요청 수신 (vsomeip → CAN, 리액터 스레드) ─────────────── */
     void on_control_request(const std::shared_ptr<vsomeip::message> &req) {
         auto payload = req->get_payload();
         auto data = payload->get_data();
@@ -196,68 +690,165 @@ private:
         app_->send(resp);
     }
 
-    /* ─────────────── CAN 수신 루프 (CAN → vsomeip Event) ─────────────── */
-    void can_listener_loop() {
+    /* ─────────────── CAN 수신 소켓 열기 ─────────────── */
+    void open_can_rx() {
         can_rx_fd_ = open_can("can0");
         if (can_rx_fd_ < 0) {
-            LOG_ERROR(g_logger, "CAN RX socket open failed");
+            LOG_ERROR(g_logger, "CAN RX socket open failed. Retrying...");
+            schedule_can_reopen();
             return;
         }
+        fcntl(can_rx_fd_, F_SETFL, fcntl(can_rx_fd_, F_GETFL) | O_NONBLOCK);
 
-        /* 특정 CAN ID(0x310) 필터링 */
-        struct can_filter flt{};
-        flt.can_id   = VEH_STATUS_CAN_ID;
-        flt.can_mask = CAN_SFF_MASK;
-        if (setsockopt(can_rx_fd_, SOL_CAN_RAW, CAN_RAW_FILTER, &flt, sizeof(flt)) < 0)
+        /* 라우팅 테이블의 모든 ID를 필터 배열 하나로 설치 */
+        std::vector<can_filter> filters = routes_.filters();
+        if (setsockopt(can_rx_fd_, SOL_CAN_RAW, CAN_RAW_FILTER, filters.data(),
+                       filters.size() * sizeof(can_filter)) < 0)
             perror("setsockopt filter");
 
-        LOG_INFO(g_logger, "[CAN] Listening on can0 (ID=0x310)");
-
-        /* poll() 기반 비차단 수신 루프 */
-        struct pollfd pfd{ .fd = can_rx_fd_, .events = POLLIN, .revents = 0 };
-        while (g_running) {
-            int pr = poll(&pfd, 1, 100);
-            if (pr <= 0) continue;
-            if (!(pfd.revents & POLLIN)) continue;
-
-            struct can_frame frame{};
-            int nbytes = read(can_rx_fd_, &frame, sizeof(frame));
-            if (nbytes < 0) continue;
-
-            /* 상태 ID(0x310) + 데이터 최소 2바이트 */
-            if ((frame.can_id & CAN_EFF_FLAG) == 0 && 
-                frame.can_id == VEH_STATUS_CAN_ID && frame.can_dlc >= 2) {
-                
-                const uint8_t status_type = frame.data[0];
-                std::vector<uint8_t> val;
-
-                /* ToF 거리 데이터(0x03)는 3바이트 값 (예: 03 00 02 28 → 0x0228 = 552mm) */
-                if (status_type == 0x03 && frame.can_dlc >= 4) {
-                    val.assign(frame.data + 1, frame.data + 4);
-                } else {
-                    val.assign(frame.data + 1, frame.data + frame.can_dlc);
+        /* 커널 소프트웨어 수신 타임스탬프 (드라이버 진입 시각, 지원 안 되면 SO_TIMESTAMPNS) */
+        int ts_flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if (setsockopt(can_rx_fd_, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags, sizeof(ts_flags)) < 0) {
+            int on = 1;
+            if (setsockopt(can_rx_fd_, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+                LOG_WARN(g_logger, "[CAN] RX timestamps unavailable, using read time");
+        }
+
+        /* 커널 소켓 큐에서 버려진 프레임 수 (SO_RXQ_OVFL cmsg) */
+        int on = 1;
+        setsockopt(can_rx_fd_, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+
+        rx_reactor_.add(can_rx_fd_, [this]() { on_can_readable(); });
+        LOG_INFO(g_logger, "[CAN] Listening on can0 (" + std::to_string(filters.size()) + " filter(s))");
+    }
+
+    void close_can_rx() {
+        if (can_rx_fd_ < 0) return;
+        rx_reactor_.remove(can_rx_fd_);
+        close(can_rx_fd_);
+        can_rx_fd_ = -1;
+        LOG_INFO(g_logger, "CAN listener stopped.");
+    }
+
+    void schedule_can_reopen() {
+        can_reopen_timer_ = rx_reactor_.add_timer(CAN_REOPEN_DELAY, 0ms, [this]() {
+            can_reopen_timer_ = -1;
+            open_can_rx();
+        });
+    }
+
+    /* ─────────────── CAN 수신 (수신 스레드) ─────────────── */
+    /* 소켓이 읽기 가능할 때만 깨어나 쌓인 프레임을 읽어 링에 넣기만 하고, 묶음마다 한 번 메인 스레드를 깨움 */
+    void on_can_readable() {
+        bool pushed = false;
+        while (true) {
+            CanRxSlot slot{};
+            char control[CMSG_SPACE(3 * sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+            iovec iov{ &slot.frame, sizeof(slot.frame) };
+            msghdr msg{};
+            msg.msg_iov        = &iov;
+            msg.msg_iovlen     = 1;
+            msg.msg_control    = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t nbytes = recvmsg(can_rx_fd_, &msg, 0);
+            if (nbytes < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    /* 인터페이스 다운 등: 소켓을 닫고 잠시 후 다시 열기 */
+                    LOG_WARN(g_logger, std::string("CAN RX error: ") + std::strerror(errno));
+                    close_can_rx();
+                    schedule_can_reopen();
                 }
+                break;
+            }
+            if (nbytes != sizeof(slot.frame) || slot.frame.can_dlc > CAN_MAX_DLEN) continue;
+
+            slot.rx_time_ns = read_rx_cmsgs(msg);
+            pushed |= can_ring_.push(slot);
+        }
+
+        if (pushed) {
+            uint64_t one = 1;
+            if (write(can_ring_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                perror("eventfd write");
+        }
+    }
 
-                /* SOME/IP Event Publish */
-                publish_status(status_type, val);
+    /* SCM_TIMESTAMPING은 [소프트웨어, (미사용), 하드웨어 원시] 순. 하드웨어 시각은 PHC 기준이라
+     * 클라이언트 시계와 비교할 수 없으므로 소프트웨어 시각만 씀. 없으면 지금 시각.
+     * SO_RXQ_OVFL(소켓 큐에서 버려진 프레임 누계)도 여기서 갱신 */
+    uint64_t read_rx_cmsgs(msghdr& msg) {
+        uint64_t rx_time_ns = 0;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET) continue;
+            if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                can_kernel_drops_.store(drops, std::memory_order_relaxed);
+                continue;
             }
+            timespec ts{};
+            if (cmsg->cmsg_type == SCM_TIMESTAMPING || cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            if (ts.tv_sec || ts.tv_nsec)
+                rx_time_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
         }
+        if (rx_time_ns) return rx_time_ns;
+        timespec now{};
+        clock_gettime(CLOCK_REALTIME, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+    }
 
-        /* 종료 시 소켓 닫기 */
-        close(can_rx_fd_); 
-        can_rx_fd_ = -1;
-        LOG_INFO(g_logger, "CAN listener stopped.");
+    /* ─────────────── CAN → vsomeip Event (메인 스레드) ─────────────── */
+    /* 링이 빌 때까지 디코딩 + 발행 */
+    void drain_can_ring() {
+        uint64_t count;
+        while (read(can_ring_fd_, &count, sizeof(count)) > 0) {}
+
+        CanRxSlot slot;
+        while (can_ring_.pop(slot)) {
+            /* 라우팅 테이블에서 디코더를 찾아 SOME/IP Event Publish */
+            const CanRoute* route = routes_.find(slot.frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+            if (route && route->decoder(slot.frame, *route, record_) && record_.event) {
+                record_.rx_time_ns = slot.rx_time_ns;
+                publish_status(record_.event, record_.type, record_.value, record_.rx_time_ns);
+            }
+        }
+        report_can_overflows();
+    }
+
+    /* 링/소켓 큐 오버플로가 늘었으면 경고 (최대 CAN_OVERFLOW_REPORT_INTERVAL마다 한 번) */
+    void report_can_overflows() {
+        const uint64_t ring = can_ring_.overflows();
+        const uint32_t kernel = can_kernel_drops_.load(std::memory_order_relaxed);
+        if (ring == reported_ring_overflows_ && kernel == reported_kernel_drops_) return;
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_overflow_report_ < CAN_OVERFLOW_REPORT_INTERVAL) return;
+        last_overflow_report_ = now;
+
+        LOG_WARN(g_logger, "[CAN] RX overflow: ring +" + std::to_string(ring - reported_ring_overflows_) +
+                           " (total " + std::to_string(ring) + "), socket +" +
+                           std::to_string(kernel - reported_kernel_drops_) +
+                           " (total " + std::to_string(kernel) + ")");
+        reported_ring_overflows_ = ring;
+        reported_kernel_drops_ = kernel;
     }
 
     /* ─────────────── 상태 이벤트 송신 ─────────────── */
-    void publish_status(uint8_t type, const std::vector<uint8_t>& val) {
-        std::vector<uint8_t> payload;
-        payload.reserve(1 + val.size());
-        payload.push_back(type);
-        payload.insert(payload.end(), val.begin(), val.end());
+    void publish_status(uint16_t event, uint8_t type, const std::vector<uint8_t>& val, uint64_t rx_time_ns) {
+        if (publish_cfg_.batch_window.count() > 0) {
+            append_to_batch(event, type, val, rx_time_ns);
+        }
+        else {
+            std::vector<uint8_t> payload;
+            payload.reserve(1 + val.size() + VEH_STATUS_TIMESTAMP_LEN);
+            append_record(payload, type, val, rx_time_ns);
 
-        auto pl = vsomeip::runtime::get()->create_payload(payload);
-        app_->notify(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, VEH_STATUS_EVENT_ID, pl);
+            auto pl = vsomeip::runtime::get()->create_payload(payload);
+            app_->notify(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, event, pl);
+        }
 
         std::ostringstream oss;
         oss << "[EVT] TYPE=0x" << std::hex << (int)type << " DATA=[";
@@ -267,6 +858,51 @@ private:
         LOG_INFO(g_logger, oss.str());
     }
 
+    /* 첫 레코드가 창을 열고, 창이 끝나거나 max_bytes에 닿으면 notify 한 번으로 보냄 */
+    void append_to_batch(uint16_t event, uint8_t type, const std::vector<uint8_t>& val, uint64_t rx_time_ns) {
+        StatusBatch& batch = batches_[event];
+        const size_t record_len = 2 + val.size() + (publish_cfg_.rx_timestamp ? VEH_STATUS_TIMESTAMP_LEN : 0);
+        if (!batch.data.empty() && batch.data.size() + record_len > publish_cfg_.batch_max_bytes)
+            flush_batch(event, batch);
+
+        if (batch.data.empty()) {
+            batch.data.reserve(publish_cfg_.batch_max_bytes);
+            batch.data.push_back(VEH_STATUS_BATCH_MARKER);
+            batch.timer = reactor_.add_timer(publish_cfg_.batch_window, 0ms, [this, event]() {
+                StatusBatch& expired = batches_[event];
+                expired.timer = -1;  // 1회 타이머는 리액터가 이미 정리함
+                flush_batch(event, expired);
+            });
+        }
+        batch.data.push_back(static_cast<uint8_t>(record_len - 1));
+        append_record(batch.data, type, val, rx_time_ns);
+
+        if (batch.data.size() + STATUS_BATCH_MIN_BYTES - 1 > publish_cfg_.batch_max_bytes)
+            flush_batch(event, batch);  // 다음 레코드가 들어갈 자리가 없음
+    }
+
+    /* [StatusType][값...] (+ rx_timestamp면 타입에 플래그, 뒤에 수신 시각 8바이트 BE) */
+    void append_record(std::vector<uint8_t>& out, uint8_t type, const std::vector<uint8_t>& val,
+                       uint64_t rx_time_ns) const {
+        if (!publish_cfg_.rx_timestamp) {
+            out.push_back(type);
+            out.insert(out.end(), val.begin(), val.end());
+            return;
+        }
+        out.push_back(type | VEH_STATUS_TIMESTAMP_FLAG);
+        out.insert(out.end(), val.begin(), val.end());
+        for (int shift = 56; shift >= 0; shift -= 8)
+            out.push_back(static_cast<uint8_t>(rx_time_ns >> shift));
+    }
+
+    void flush_batch(uint16_t event, StatusBatch& batch) {
+        reactor_.cancel_timer(batch.timer);
+        if (batch.data.empty()) return;
+        auto pl = vsomeip::runtime::get()->create_payload(batch.data);
+        app_->notify(VEH_STATUS_SERVICE_ID, VEH_STATUS_INSTANCE_ID, event, pl);
+        batch.data.clear();
+    }
+
     /* ─────────────── CAN 소켓 오픈 함수 ─────────────── */
     static int open_can(const char* ifname) {
         int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
@@ -288,12 +924,17 @@ private:
 };
 
 /* ─────────────── 메인 함수 ─────────────── */
-int main() {
-    signal(SIGINT,  on_signal);
-    signal(SIGTERM, on_signal);
+/* 사용법: veh_unified_server [설정 파일]  (예: resources/veh_can_routes.conf) */
+int main(int argc, char* argv[]) {
+    /* vsomeip가 스레드를 만들기 전에 막아 두어야 모든 스레드에서 signalfd로만 전달됨 */
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
 
     VehUnifiedServer server;
-    if (!server.init()) return -1;
+    if (!server.init(stop_signals, argc > 1 ? argv[1] : nullptr)) return -1;
 
     server.start();
     return 0;
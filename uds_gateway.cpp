@@ -1,30 +1,96 @@
 #include <iostream>
 #include <vector>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/isotp.h>
 #include <algorithm> // for std::min
 #include <csignal>
-#include <thread> // for std::this_thread::sleep_for
-#include <chrono> // for std::chrono::microseconds
-#include <mutex>   // 스레드 동기화를 위한 뮤텍스
-#include <atomic>  // 스레드 종료 플래그를 위한 아토믹
-#include <condition_variable>
-#include <queue> 
-
-// --- 설정값 ---
+#include <chrono>    // 타이머 마감시각 계산
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifndef CANFD_FDF
+#define CANFD_FDF 0x04 // 오래된 커널 헤더 (트레이스에서 FD 프레임 표시용)
+#endif
+
+// --- 설정값 (설정 파일이 없거나 항목이 빠졌을 때의 기본값) ---
 const char* CAN_INTERFACE = "can0";
 const int DOIP_PORT = 13400;
 const int UDS_REQUEST_CAN_ID = 0x7E0;   // 라즈베리파이 -> TC375
 const int UDS_RESPONSE_CAN_ID = 0x7E8; // TC375 -> 라즈베리파이
 const uint16_t CLIENT_LOGICAL_ADDRESS = 0x0E00;
-const uint16_t SERVER_LOGICAL_ADDRESS = 0x1000;
-const uint16_t MAX_CONSECUTIVE_FRAMES_IN_BLOCK = 4095; // BS=0일 때 보낼 최대 프레임 수
+const uint16_t SERVER_LOGICAL_ADDRESS = 0x1000;        // 게이트웨이(DoIP 엔티티) 및 기본 ECU 주소
+const int MAX_DOIP_SESSIONS = 8;                       // 동시에 붙을 수 있는 진단기 수
+const uint32_t MAX_DOIP_PAYLOAD_LENGTH = 1 << 20;      // 이보다 큰 페이로드 길이는 잘못된 헤더로 간주
+const size_t MAX_SESSION_TX_BACKLOG = 1 << 20;         // 진단기가 읽지 않아 쌓인 송신 데이터 한도
+const int FC_TIMEOUT_MS = 1000;                        // FC 대기 타임아웃 (N_Bs, ISO 15765-2)
+const int CF_TIMEOUT_MS = 1000;                        // CF 수신 타임아웃 (N_Cr, ISO 15765-2)
+const int P2_SERVER_MS = 50;                           // ECU가 첫 응답을 보내야 하는 시간 (ISO 14229-2 기본값)
+const int P2_STAR_SERVER_MS = 5000;                    // 0x78(응답 지연) 이후 다음 응답까지의 시간
+const int P2_MARGIN_MS = 100;                          // 버스/게이트웨이 지연 여유 (ΔP2): 서버 값에 더해 마감으로 씀
+const uint8_t NRC_RESPONSE_TIMEOUT = 0x10;             // P2/P2* 만료 시 게이트웨이가 대신 돌려주는 NRC (generalReject)
+const uint8_t NRC_CAN_TX_FAILED = 0x10;                // 기능 주소 요청을 CAN으로 보내지 못했을 때 돌려주는 NRC (generalReject)
+const size_t KERNEL_ISOTP_MAX_PDU = 8300;              // can-isotp 모듈 max_pdu_size 기본값 (커널 백엔드 응답 마감 계산용)
+const int CAN_TX_RETRY_MS = 1;                         // CAN 송신 큐가 가득 찼을 때 재시도 간격
+const size_t ISOTP_FF_DL_12BIT_MAX = 4095;             // 이보다 긴 메시지는 FF_DL=0 + 32비트 길이(escape) 사용
+const size_t ISOTP_MAX_PDU = MAX_DOIP_PAYLOAD_LENGTH - 4; // DoIP 진단 메시지 하나(SA/TA 제외)에 담을 수 있는 최대 UDS 길이
+const size_t CF_BURST_MAX = 32;                        // STmin=0일 때 sendmmsg() 한 번에 묶을 CF 수
+const int STMIN_SPIN_US = 200;                         // STmin 마감 직전 바쁜 대기로 맞추는 구간
+const uint8_t CAN_FD_PADDING = 0xCC;                   // FD 프레임을 유효한 DLC 길이로 맞출 때 채우는 값
+const uint8_t FC_DEFAULT_BS = 0x00;                    // 수신 시 ECU에 보낼 FC 기본값 (BS=0: 한 번에 전부)
+const uint8_t FC_DEFAULT_STMIN = 0x0A;                 // 수신 시 ECU에 보낼 FC 기본값 (STmin=10ms)
+// 적응형 FC: 0부터 시작해 오버플로/순서 오류 때마다 한 칸씩 느리게 (0, 500us, 1, 2, 5, 10, 20ms)
+const uint8_t ADAPTIVE_STMIN_STEPS[] = { 0x00, 0xF5, 0x01, 0x02, 0x05, 0x0A, 0x14 };
+const int ADAPTIVE_FC_RECOVER_AFTER = 16;              // 연속 정상 수신이 이만큼 쌓이면 한 칸 빠르게
+const int EPOLL_MAX_EVENTS = 32;
+// 플래시 다운로드 가속: 0x34 이후 진단기가 이미지를 이 제조사 정의 페이로드 타입으로 연속 전송
+// 페이로드 = [SA 2][TA 2][이미지 조각...], 응답은 마지막 0x37 결과(또는 중단 사유) 하나뿐
+const uint16_t DOIP_TYPE_FLASH_STREAM = 0xF001;
+const int FLASH_STREAM_IDLE_MS = 5000;                 // 이미지가 덜 왔는데 스트림이 이만큼 끊기면 다운로드를 중단하고 채널을 놓음
+const size_t SESSION_RX_BUFFER_SIZE = 64 * 1024;       // 세션 수신 버퍼 초기 크기 (더 큰 메시지가 오면 그만큼 늘림)
+const int SESSION_TX_IOV_MAX = 64;                     // 송신 대기열을 writev 한 번에 묶어 보낼 최대 메시지 수
+const int PERIODIC_FLUSH_MS = 10;                      // 주기 DID 레코드를 모아 한 번에 보내는 창
+const size_t PERIODIC_BATCH_MAX = 16 * 1024;           // 창이 끝나기 전이라도 이만큼 모이면 바로 보냄
+const int REQUEST_QUEUE_LIMIT = 16;                    // ECU별 대기+진행 중 요청 한도 (넘으면 DoIP NACK 0x05)
+const size_t REQUEST_BUFFER_POOL = 4;                  // ECU별로 송신이 끝난 요청 버퍼를 재사용하려고 남겨 두는 수
+const int CONTROL_QUEUE_RESERVE = 4;                   // 제어 요청(0x3E/0x10/0x11 등)에만 추가로 허용하는 자리
+const size_t BULK_REQUEST_BYTES = 256;                 // 이보다 긴 요청은 대용량 우선순위로 보냄
+const uint16_t FUNCTIONAL_ADDRESS = 0xE400;            // 기능 주소 요청용 DoIP 타깃 주소 (모든 ECU)
+const int FUNCTIONAL_REQUEST_CAN_ID = 0x7DF;           // 기능 주소 요청 CAN ID (OBD 브로드캐스트)
+const int FUNCTIONAL_WINDOW_MS = 100;                  // 기능 요청 후 ECU 응답을 모으는 창
+const int FUNCTIONAL_PENDING_MS = 5000;                // 창 안에서 0x78(응답 지연)을 받으면 이만큼 늘림
+const int TESTER_PRESENT_MS = 2000;                    // 기본 세션이 아닐 때 게이트웨이가 보내는 0x3E 0x80 주기 (S3 5초보다 짧게)
+const int KEEPALIVE_RETRY_MS = 50;                     // 채널이 바빠 건너뛴 뒤 다시 확인하는 간격
+const int METRICS_PORT = 0;                            // Prometheus 텍스트 엔드포인트 (127.0.0.1, 0 = 끔)
+const int MAX_METRICS_CLIENTS = 4;
+const size_t METRICS_REQUEST_MAX = 4096;               // HTTP 요청 헤더 한도
+const int METRICS_CLIENT_TIMEOUT_MS = 2000;
+const size_t TRACE_FRAMES = 16384;                     // 트레이스 링 크기 (2의 거듭제곱으로 올림, 0 = 끔)
+const size_t TRACE_SNAPLEN = 64;                       // DoIP 메시지는 앞부분(헤더+SA/TA+UDS 앞쪽)만 기록
+const char* TRACE_DIR = "/tmp";                        // SIGUSR1(pcapng)/SIGUSR2(candump 로그) 덤프 위치
+// 지연 히스토그램 버킷 상한 (초)
+const double LATENCY_BUCKETS[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+const int LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS) / sizeof(LATENCY_BUCKETS[0]);
 
 // --- DoIP 헤더 구조체 (Big Endian) ---
 #pragma pack(push, 1)
@@ -36,37 +102,898 @@ struct DoIPHeader {
 };
 #pragma pack(pop)
 
-// --- 전역 변수 (스레드 동기화) ---
-std::mutex client_socket_mutex;                  // DoIP 소켓 쓰기 동작을 보호하기 위한 뮤텍스
-std::mutex fc_queue_mutex;                       // FC 프레임 큐 접근을 보호하기 위한 뮤텍스
-std::condition_variable fc_queue_cv;             // FC 큐에 아이템이 생길 때까지 대기하기 위한 Condition Variable
-std::queue<std::vector<uint8_t>> fc_frame_queue; // CAN 스레드가 받은 FC 프레임을 메인 스레드에 전달하기 위한 큐
+using Clock = std::chrono::steady_clock;
+
+// --- 게이트웨이 설정 (라우팅 테이블) ---
+// ISO-TP 엔진: USER = 이 파일의 유저스페이스 구현, KERNEL = 리눅스 CAN_ISOTP 소켓
+enum class IsoTpBackend { USER, KERNEL };
+
+// DoIP 타깃 주소 하나가 CAN 요청/응답 ID 한 쌍(= ECU 하나)에 대응합니다.
+struct EcuConfig {
+    std::string name;
+    uint16_t logical_address = 0;
+    uint32_t tx_id = 0; // 게이트웨이 -> ECU (29비트 ID면 CAN_EFF_FLAG 포함)
+    uint32_t rx_id = 0; // ECU -> 게이트웨이
+    IsoTpBackend backend = IsoTpBackend::USER;
+    uint8_t fc_bs = FC_DEFAULT_BS;       // 수신 시 보낼 FC의 BS
+    uint8_t fc_stmin = FC_DEFAULT_STMIN; // 수신 시 보낼 FC의 STmin (fc_adaptive면 무시)
+    bool fc_adaptive = false;
+    bool can_fd = false;                 // true면 CAN FD 프레임(최대 64바이트)으로 ISO-TP 송수신
+    uint32_t periodic_rx_id = 0;         // 주기 DID(0x2A) 전용 CAN ID (0 = 응답 ID의 SF로 받음)
+    int queue_limit = REQUEST_QUEUE_LIMIT; // 대기+진행 중 요청 한도
+    int p2_server_ms = P2_SERVER_MS;
+    int p2_star_server_ms = P2_STAR_SERVER_MS;
+    bool timing_fixed = false;           // p2=/p2star=를 준 ECU는 0x50 응답의 타이밍 값을 따르지 않음
+    std::map<uint16_t, int> did_cache_ttl_ms = {}; // RDBI 캐시를 켠 DID -> 유효 시간 (비어 있으면 캐시 안 함)
+};
+
+struct GatewayConfig {
+    std::string can_interface = CAN_INTERFACE;
+    int doip_port = DOIP_PORT;
+    uint16_t gateway_address = SERVER_LOGICAL_ADDRESS;
+    IsoTpBackend isotp_backend = IsoTpBackend::USER; // ecu 줄에서 isotp= 를 생략했을 때의 기본값
+    int stmin_spin_us = STMIN_SPIN_US;
+    int periodic_flush_ms = PERIODIC_FLUSH_MS; // 0이면 주기 DID 레코드를 받는 즉시 전송
+    uint16_t functional_address = FUNCTIONAL_ADDRESS;
+    uint32_t functional_tx_id = FUNCTIONAL_REQUEST_CAN_ID;
+    int functional_window_ms = FUNCTIONAL_WINDOW_MS;
+    int tester_present_ms = TESTER_PRESENT_MS;  // 0이면 TesterPresent 대행을 끔
+    int metrics_port = METRICS_PORT;
+    size_t trace_frames = TRACE_FRAMES;
+    std::string trace_dir = TRACE_DIR;
+    bool log_messages = false;  // 메시지/프레임마다 콘솔 로그 (디버깅용, 평소에는 트레이스 링으로 충분)
+    std::vector<EcuConfig> ecus;
+};
+
+// --- 이벤트 루프 (epoll 리액터) ---
+// 리슨 소켓, 진단기 TCP 소켓, CAN 소켓, 타이머를 하나의 스레드에서 다중화합니다.
+// 타이머는 timerfd 하나에 가장 이른 마감시각(CLOCK_MONOTONIC 절대값)만 걸어 두고 관리합니다.
+class Reactor {
+public:
+    using IoHandler = std::function<void(uint32_t events)>;
+    using TimerHandler = std::function<void()>;
+    using TimerId = uint64_t;
+
+    bool init() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (epoll_fd_ < 0 || timer_fd_ < 0) return false;
+        return add(timer_fd_, EPOLLIN, [this](uint32_t) { on_timer_fd(); });
+    }
+
+    bool add(int fd, uint32_t events, IoHandler handler) {
+        uint32_t gen = ++next_gen_;
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) return false;
+        handlers_[fd] = Entry{ gen, std::make_shared<IoHandler>(std::move(handler)) };
+        return true;
+    }
+
+    bool modify(int fd, uint32_t events) {
+        auto it = handlers_.find(fd);
+        if (it == handlers_.end()) return false;
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = (static_cast<uint64_t>(it->second.gen) << 32) | static_cast<uint32_t>(fd);
+        return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+    }
+
+    void remove(int fd) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        handlers_.erase(fd);
+    }
+
+    TimerId add_timer(Clock::time_point deadline, TimerHandler handler) {
+        TimerId id = ++next_timer_id_;
+        timers_.emplace(std::make_pair(deadline, id), std::move(handler));
+        timer_deadlines_[id] = deadline;
+        if (timers_.begin()->first.second == id) arm_timer_fd();
+        return id;
+    }
+
+    TimerId add_timer_ms(int ms, TimerHandler handler) {
+        return add_timer(Clock::now() + std::chrono::milliseconds(ms), std::move(handler));
+    }
+
+    // 해제 후 id를 0으로 돌려놓아 "타이머 없음" 상태를 표시합니다.
+    void cancel_timer(TimerId& id) {
+        if (id == 0) return;
+        auto it = timer_deadlines_.find(id);
+        if (it != timer_deadlines_.end()) {
+            timers_.erase(std::make_pair(it->second, id));
+            timer_deadlines_.erase(it);
+        }
+        id = 0;
+    }
+
+    void run() {
+        epoll_event events[EPOLL_MAX_EVENTS];
+        while (true) {
+            int n = epoll_wait(epoll_fd_, events, EPOLL_MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = static_cast<int>(events[i].data.u64 & 0xFFFFFFFF);
+                uint32_t gen = static_cast<uint32_t>(events[i].data.u64 >> 32);
+                auto it = handlers_.find(fd);
+                // 같은 배치 안에서 이미 닫혔거나 번호가 재사용된 fd의 이벤트는 버립니다.
+                if (it == handlers_.end() || it->second.gen != gen) continue;
+                std::shared_ptr<IoHandler> handler = it->second.handler;
+                (*handler)(events[i].events);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        uint32_t gen;
+        std::shared_ptr<IoHandler> handler;
+    };
+
+    int epoll_fd_ = -1;
+    int timer_fd_ = -1;
+    uint32_t next_gen_ = 0;
+    TimerId next_timer_id_ = 0;
+    std::unordered_map<int, Entry> handlers_;
+    std::map<std::pair<Clock::time_point, TimerId>, TimerHandler> timers_;
+    std::unordered_map<TimerId, Clock::time_point> timer_deadlines_;
+
+    void on_timer_fd() {
+        uint64_t expirations;
+        while (read(timer_fd_, &expirations, sizeof(expirations)) > 0) {}
+
+        auto now = Clock::now();
+        while (!timers_.empty() && timers_.begin()->first.first <= now) {
+            auto node = timers_.begin();
+            TimerHandler handler = std::move(node->second);
+            timer_deadlines_.erase(node->first.second);
+            timers_.erase(node);
+            handler();
+        }
+        arm_timer_fd();
+    }
+
+    void arm_timer_fd() {
+        itimerspec its{};
+        if (!timers_.empty()) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                timers_.begin()->first.first.time_since_epoch()).count();
+            if (ns <= 0) ns = 1; // 0은 타이머 해제를 뜻하므로 피함
+            its.it_value.tv_sec = ns / 1000000000;
+            its.it_value.tv_nsec = ns % 1000000000;
+        }
+        timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, nullptr);
+    }
+};
+
+// --- 고정 DoIP 응답 템플릿 ---
+// 헤더와 고정 필드를 미리 직렬화해 두고, 보낼 때 스택에 복사해 주소/코드만 채웁니다.
+const uint8_t ROUTING_ACTIVATION_RESPONSE_TEMPLATE[] = { // 0x0006: [진단기 SA][엔티티 주소][코드][예약 4]
+    0x02, 0xFD, 0x00, 0x06, 0x00, 0x00, 0x00, 0x09, 0, 0, 0, 0, 0x10, 0, 0, 0, 0 };
+const uint8_t DIAGNOSTIC_ACK_TEMPLATE[] = {              // 0x8002/0x8003: [SA][TA][ACK/NACK 코드]
+    0x02, 0xFD, 0x80, 0x02, 0x00, 0x00, 0x00, 0x05, 0, 0, 0, 0, 0x00 };
+const uint8_t ALIVE_CHECK_RESPONSE_TEMPLATE[] = {        // 0x0008: [진단기 SA]
+    0x02, 0xFD, 0x00, 0x08, 0x00, 0x00, 0x00, 0x02, 0, 0 };
+const uint8_t GENERIC_NACK_TEMPLATE[] = {                // 0x0000: [NACK 코드]
+    0x02, 0xFD, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0 };
+
+inline void put_be16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+// --- ISO-TP로 받은 UDS 메시지 ---
+// 앞쪽에 DoIP 진단 메시지 헤더(+SA/TA, 필요 시 0x62 접두어)를 채울 자리를 비워 두고 재조립하므로,
+// 진단기에 보낼 때 헤더만 채워 버퍼째 송신 대기열로 넘깁니다 (페이로드 복사 없음).
+const size_t DOIP_DIAG_HEADROOM = sizeof(DoIPHeader) + 4 + 1;
+
+struct UdsMessage {
+    std::vector<uint8_t> buf = std::vector<uint8_t>(DOIP_DIAG_HEADROOM);
+
+    UdsMessage() = default;
+    UdsMessage(const uint8_t* p, size_t n) { append(p, n); }
+    size_t size() const { return buf.size() - DOIP_DIAG_HEADROOM; }
+    bool empty() const { return size() == 0; }
+    const uint8_t* data() const { return buf.data() + DOIP_DIAG_HEADROOM; }
+    uint8_t operator[](size_t i) const { return buf[DOIP_DIAG_HEADROOM + i]; }
+    void append(const uint8_t* p, size_t n) { buf.insert(buf.end(), p, p + n); }
+    void reserve(size_t n) { buf.reserve(DOIP_DIAG_HEADROOM + n); }
+    void clear() { buf.resize(DOIP_DIAG_HEADROOM); }
+};
+
+// --- 세션 수신 버퍼 ---
+// [head, tail)이 아직 처리하지 않은 바이트입니다. read()는 tail 뒤 빈 자리에 바로 쓰고 메시지는 버퍼 안에서
+// 그대로 파싱하므로, 끝에 닿았을 때만 남은 조각을 앞으로 당기고(메시지가 중간에서 끊기지 않도록) 필요하면 늘립니다.
+struct RxBuffer {
+    std::vector<uint8_t> buf = std::vector<uint8_t>(SESSION_RX_BUFFER_SIZE);
+    size_t head = 0;
+    size_t tail = 0;
+
+    size_t size() const { return tail - head; }
+    const uint8_t* data() const { return buf.data() + head; }
+    size_t writable() const { return buf.size() - tail; }
+    void commit(size_t n) { tail += n; }
+    void consume(size_t n) {
+        head += n;
+        if (head == tail) head = tail = 0;
+    }
+    // 처리 대기 중인 메시지 전체(need 바이트)가 연속으로 들어갈 자리를 만들고 쓰기 위치를 돌려줍니다.
+    uint8_t* prepare(size_t need) {
+        need = std::max(need, size() + 1);
+        if (buf.size() - head < need) {
+            memmove(buf.data(), buf.data() + head, size());
+            tail -= head;
+            head = 0;
+        }
+        if (buf.size() < need) buf.resize(need);
+        return buf.data() + tail;
+    }
+};
+
+// 송신 대기열 항목: data[offset..]이 아직 보내지 않은 부분 (headroom 중 안 쓴 앞부분도 offset으로 건너뜀)
+struct TxChunk {
+    std::vector<uint8_t> data;
+    size_t offset = 0;
+};
+
+// --- DoIP 세션 (진단기 TCP 연결 하나당 하나) ---
+struct DoipSession {
+    uint64_t id = 0;
+    int fd = -1;
+    uint16_t tester_address = CLIENT_LOGICAL_ADDRESS; // 라우팅 활성화 요청에서 받은 진단기 주소
+    bool closing = false;                             // 쓰기 실패 등으로 정리 대기 중
+    bool rx_paused = false;                           // 플래시 스트림 버퍼가 차서 읽기를 잠시 멈춤
+    bool routing_active = false;                      // 라우팅 활성화(0x0005)를 마친 세션만 진단 메시지 허용
+    size_t rx_discard = 0;                            // 너무 커서 거절한 메시지 중 아직 버려야 할 바이트
+    RxBuffer rx;                                      // 아직 처리하지 않은 수신 바이트
+    size_t rx_need = 0;                               // 다음 메시지를 끝까지 받으려면 필요한 바이트 수
+    std::deque<TxChunk> tx_queue;                     // 소켓이 막혀 아직 못 보낸 DoIP 메시지
+    size_t tx_backlog = 0;                            // tx_queue에 쌓인 총 바이트 수
+    std::vector<uint8_t> periodic_batch;              // 아직 보내지 않은 주기 DID 레코드 (DoIP 메시지를 이어 붙임)
+    Reactor::TimerId periodic_timer = 0;              // 주기 DID 묶음 전송 창
+};
+
+// --- ISO-TP 링크 (ECU 하나와의 송수신 상태) ---
+enum class IsoTpTxState { IDLE, WAIT_FC, SENDING_CF, IN_KERNEL };
+
+// STmin 페이싱 정확도 (요구 간격 대비 실제 CF 간격의 초과분)
+struct PacingStats {
+    uint64_t frames = 0;
+    int64_t late_sum_us = 0;
+    long max_late_us = 0;
+
+    void record(long late_us) {
+        ++frames;
+        late_sum_us += late_us;
+        max_late_us = std::max(max_late_us, late_us);
+    }
+    long mean_late_us() const { return frames ? (long)(late_sum_us / (int64_t)frames) : 0; }
+};
+
+// 요청 우선순위: 세션 사이에서 어느 세션의 맨 앞 요청을 먼저 보낼지 정할 때만 씁니다 (작은 값이 먼저).
+// 한 세션 안에서는 진단기가 보낸 순서(FIFO)를 그대로 지킵니다.
+enum RequestPriority {
+    PRIORITY_CONTROL,  // TesterPresent, 세션 변경, 리셋, DTC 삭제 등 지연에 민감한 짧은 요청
+    PRIORITY_NORMAL,
+    PRIORITY_BULK,     // 다운로드/업로드, 메모리 읽기·쓰기, 다중 DID 읽기, 긴 요청
+    PRIORITY_COUNT
+};
+
+struct PendingRequest {
+    uint64_t session_id = 0;
+    std::vector<uint8_t> uds;
+    bool flash = false; // 게이트웨이가 만든 0x36/0x37 (응답을 진단기에 바로 넘기지 않음)
+    RequestPriority priority = PRIORITY_NORMAL;
+};
+
+// 기능 주소 요청: 모든 ECU 채널이 빌 때까지 기다렸다가 SF 한 번으로 보내고, 응답 창이 열려 있는 동안은
+// 물리 요청을 보내지 않아 각 ECU 채널에 들어오는 응답이 곧 이 요청의 응답이 되도록 합니다.
+struct FunctionalRequests {
+    std::deque<PendingRequest> pending;
+    bool active = false;              // 응답 창이 열려 있음
+    uint64_t session_id = 0;          // 응답을 돌려줄 세션
+    Reactor::TimerId window_timer = 0;
+    Reactor::TimerId retry_timer = 0; // CAN 송신 큐가 가득 차 맨 앞 요청을 다시 보내려고 기다리는 중
+    int responses = 0;                // 이번 창에서 전달한 최종 응답 수
+};
+
+// 0x34 RequestDownload 이후 진단기가 스트리밍한 이미지를 0x36 블록으로 나눠 게이트웨이가 직접 전송
+struct FlashDownload {
+    uint64_t session_id = 0;          // 0x34를 보낸 세션 (0 = 비활성)
+    bool streaming = false;           // 0x74를 받아 이미지 스트림을 받는 중
+    size_t total = 0;                 // 0x34의 memorySize
+    size_t block_data_len = 0;        // maxNumberOfBlockLength - 2 (SID, 블록 번호 제외)
+    size_t received = 0;              // 진단기에서 받은 이미지 바이트
+    size_t queued = 0;                // 0x36 블록으로 만든 바이트
+    size_t acked = 0;                 // ECU가 0x76으로 확인한 바이트
+    uint8_t block_counter = 1;        // 다음 blockSequenceCounter
+    std::vector<uint8_t> stream;      // 아직 블록으로 만들지 않은 이미지 (stream_offset부터 유효)
+    size_t stream_offset = 0;
+    std::vector<uint8_t> next_block;  // 현재 블록이 버스에 있는 동안 미리 만들어 둔 다음 0x36 요청
+    size_t next_block_len = 0;
+    size_t in_flight_len = 0;         // ECU 응답을 기다리는 블록의 데이터 길이
+    bool block_in_flight = false;
+    bool exit_sent = false;           // 0x37을 보냄
+    Clock::time_point started;
+    Reactor::TimerId idle_timer = 0;  // 진단기 스트림 무활동 감시 (FLASH_STREAM_IDLE_MS)
+};
+
+// --- 메트릭 ---
+// 모든 값은 리액터 스레드에서만 갱신하고 읽으므로 원자 연산이 필요 없습니다.
+struct Histogram {
+    uint64_t buckets[LATENCY_BUCKET_COUNT] = {}; // 버킷별 개수 (출력할 때 누적)
+    uint64_t count = 0;
+    double sum = 0;
+
+    void observe(double seconds) {
+        for (int i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+            if (seconds <= LATENCY_BUCKETS[i]) {
+                buckets[i]++;
+                break;
+            }
+        }
+        count++;
+        sum += seconds;
+    }
+};
+
+struct LinkMetrics {
+    uint64_t requests_by_sid[256] = {};
+    uint64_t uds_tx_bytes = 0;          // 게이트웨이 -> ECU (UDS 바이트)
+    uint64_t uds_rx_bytes = 0;          // ECU -> 게이트웨이
+    uint64_t fc_waits = 0;
+    uint64_t fc_timeouts = 0;
+    uint64_t cf_sequence_errors = 0;
+    uint64_t cf_timeouts = 0;
+    uint64_t p2_timeouts = 0;           // 0x78 없이 P2 안에 응답이 오지 않음
+    uint64_t p2_star_timeouts = 0;      // 0x78 이후 P2* 안에 다음 응답이 오지 않음
+    uint64_t response_pending = 0;      // 받은 0x78 수
+    uint64_t stale_responses = 0;       // 진행 중인 요청과 SID가 맞지 않거나 마감이 지난 뒤 온 응답 (버림)
+    uint64_t keepalives_sent = 0;       // 게이트웨이가 대신 보낸 0x3E 0x80
+    uint64_t keepalives_absorbed = 0;   // 진단기가 보낸 0x3E 중 게이트웨이가 처리한 것
+    double stmin_wait_seconds = 0;      // STmin 간격을 지키느라 CF 사이에 쉰 시간
+    double stmin_spin_seconds = 0;      // 그중 바쁜 대기로 CPU를 쓴 시간
+    Histogram fc_wait;                  // FF/블록 끝 -> FC(CTS) 수신
+    std::map<uint8_t, Histogram> response_by_sid; // 요청 송신 완료 -> 최종 응답 수신 완료 (0x78 대기 포함)
+};
+
+struct GatewayMetrics {
+    uint64_t sessions_accepted = 0;
+    uint64_t sessions_rejected = 0;
+    uint64_t doip_rx_bytes = 0;         // 진단기 -> 게이트웨이
+    uint64_t doip_tx_bytes = 0;         // 게이트웨이 -> 진단기
+    uint64_t functional_requests = 0;
+    uint64_t functional_responses = 0;  // 기능 요청에 ECU들이 보낸 최종 응답 수
+};
+
+// --- 트레이스 링 ---
+// 모든 CAN 프레임과 DoIP 메시지를 고정 크기 링에 덮어쓰며 기록합니다. 리액터 스레드만 쓰므로 잠금이 없고,
+// 기록 한 건은 시각 읽기와 슬롯 하나 복사뿐입니다. 덤프는 fork()한 자식이 스냅샷을 파일로 씁니다.
+enum TraceKind : uint8_t { TRACE_CAN, TRACE_DOIP };
+enum TraceDirection : uint8_t { TRACE_RX, TRACE_TX };
+
+struct TraceRecord {
+    int64_t timestamp_ns;         // CLOCK_MONOTONIC
+    uint32_t id;                  // CAN: can_id (EFF 플래그 포함), DoIP: 세션 번호
+    uint32_t length;              // 원래 길이 (DoIP는 잘리기 전)
+    uint8_t kind;
+    uint8_t direction;
+    uint8_t flags;                // CAN: canfd_frame.flags (FD면 CANFD_FDF 포함)
+    uint8_t captured;             // data에 담긴 바이트 수
+    uint8_t data[TRACE_SNAPLEN];
+};
+
+struct TraceRing {
+    std::vector<TraceRecord> slots; // 크기는 2의 거듭제곱
+    uint64_t next = 0;              // 누적 기록 수 (& mask = 다음 슬롯)
+
+    TraceRecord* claim() {
+        if (slots.empty()) return nullptr;
+        TraceRecord* r = &slots[next++ & (slots.size() - 1)];
+        r->timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+        return r;
+    }
+};
+
+// RDBI(0x22) 긍정 응답 캐시 항목
+struct DidCacheEntry {
+    std::vector<uint8_t> response; // 0x62 DID 데이터...
+    Clock::time_point expires;
+};
+
+struct IsoTpLink {
+    EcuConfig cfg;
+    int isotp_sock = -1; // KERNEL 백엔드일 때의 CAN_ISOTP 소켓
+
+    // 송신 상태
+    IsoTpTxState tx_state = IsoTpTxState::IDLE;
+    std::vector<uint8_t> tx_data;
+    std::vector<std::vector<uint8_t>> request_pool; // 송신이 끝난 요청 버퍼 (다음 요청이 용량을 재사용)
+    size_t tx_offset = 0;
+    uint8_t tx_seq = 0;
+    uint8_t tx_block_size = 0;     // FC의 BS (0 = 블록 제한 없음)
+    uint16_t tx_block_sent = 0;    // 이번 블록에서 보낸 CF 수
+    long tx_stmin_us = 0;
+    Clock::time_point tx_last_cf_time; // 직전 CF 송신 시각 (다음 STmin 마감의 기준)
+    PacingStats tx_pacing;             // 현재 전송의 페이싱 지연 통계
+    Reactor::TimerId tx_timer = 0;     // FC 타임아웃 또는 STmin 대기
+    Clock::time_point fc_wait_started; // FC 대기 시작 시각
+
+    // 수신 시 ECU에 보내는 FC 파라미터 (적응형이면 fc_level에 따라 바뀜)
+    uint8_t rx_fc_bs = FC_DEFAULT_BS;
+    uint8_t rx_fc_stmin = FC_DEFAULT_STMIN;
+    int fc_level = 0;             // ADAPTIVE_STMIN_STEPS 인덱스
+    int fc_clean_streak = 0;      // 마지막 백오프 이후 연속 정상 수신 수
+    bool fc_reopen_pending = false; // 커널 백엔드: 채널이 완전히 빌 때 새 FC 값으로 소켓 재생성
+    bool isotp_in_event = false;    // 커널 소켓 이벤트 처리(읽기 루프) 중: 소켓을 바꾸면 안 됨
+
+    // 수신(재조립) 상태
+    bool rx_active = false;
+    UdsMessage rx_buffer;
+    size_t rx_expected = 0;
+    uint8_t rx_seq = 0;
+    Reactor::TimerId rx_timer = 0; // CF 수신 타임아웃
+
+    // 요청 중재: 여러 진단기의 요청을 한 번에 하나씩 ECU로 보내고,
+    // 응답이 올 때까지 채널을 점유해 응답이 다른 세션으로 섞이지 않게 합니다.
+    // 우선순위별·세션별 대기열: 제어 요청은 대용량 전송 뒤에 줄 서지 않고,
+    // 한 진단기의 긴 요청 묶음이 다른 진단기를 막지 않도록 세션 사이를 돌아가며 꺼냅니다.
+    std::map<uint64_t, std::deque<PendingRequest>> pending; // 세션별 FIFO
+    uint64_t last_served_session[PRIORITY_COUNT] = {};
+    uint64_t queue_rejects = 0;    // 대기열이 가득 차 NACK한 요청 수
+    uint64_t owner_session = 0;    // 응답을 돌려줄 세션 (마지막 요청자)
+    bool owner_flash = false;      // 현재 요청이 플래시 가속기가 만든 블록인지
+    // 응답 타이밍: 요청을 다 보내면 P2 안에 첫 응답을, 0x78을 받을 때마다 P2* 안에 다음 응답을 기다립니다.
+    bool awaiting_response = false;
+    Reactor::TimerId response_timer = 0;
+    Clock::time_point request_sent_at; // 응답 지연 측정 기준
+    int p2_ms = P2_SERVER_MS + P2_MARGIN_MS;           // 현재 마감 (ECU가 0x50으로 알려 준 값 + 여유)
+    int p2_star_ms = P2_STAR_SERVER_MS + P2_MARGIN_MS;
+    uint16_t pending_responses = 0;    // 현재 요청에 받은 0x78 수
+    int response_deadline_ms = 0;      // 지금 걸린 응답 마감 (로그용)
+    Clock::time_point last_request_at; // 마지막으로 ECU에 요청을 보낸 시각 (S3 타이머가 다시 시작된 시점)
+
+    // TesterPresent 대행: 기본 세션이 아닌 동안 게이트웨이가 0x3E 0x80을 보내 세션을 유지
+    uint64_t keepalive_session = 0;    // 세션을 연 진단기 세션 (0 = 대행 안 함)
+    Reactor::TimerId keepalive_timer = 0;
+
+    FlashDownload flash;
+
+    // RDBI 캐시: 0x2E/세션 변경이 지나가면 generation을 올려, 그 전에 나간 0x22의 응답은 캐시에 넣지 않음
+    std::unordered_map<uint16_t, DidCacheEntry> did_cache;
+    uint64_t did_cache_generation = 0;
+    int inflight_did = -1;               // 응답을 기다리는 단일 DID 0x22 요청의 DID (-1 = 해당 없음)
+    uint64_t inflight_did_generation = 0;
+    uint64_t did_cache_hits = 0;
+    uint64_t did_cache_misses = 0;
+
+    // 주기 DID(0x2A): periodicDataIdentifier(DID 0xF2xx의 하위 바이트) -> 예약한 세션
+    std::map<uint8_t, uint64_t> periodic_owner;
+    std::vector<uint8_t> inflight_periodic; // 응답을 기다리는 0x2A 요청 (긍정 응답 때 예약표에 반영)
+    uint8_t inflight_sid = 0;               // 응답을 기다리는 요청의 SID
+    bool inflight_expired = false;          // P2/P2*가 지나 포기한 요청: 다음 요청을 보낼 때까지 오는 응답은 버림
+    uint64_t periodic_records = 0;
+
+    LinkMetrics metrics;
+};
+
+// --- 전역 상태 (모두 리액터 스레드에서만 접근) ---
+GatewayConfig g_config;
+Reactor g_reactor;
+int g_can_sock = -1;
+std::map<uint16_t, IsoTpLink> g_links;                 // DoIP 타깃 주소 -> ISO-TP 채널
+std::unordered_map<uint32_t, IsoTpLink*> g_links_by_rx_id; // CAN 응답 ID -> ISO-TP 채널
+std::unordered_map<uint32_t, IsoTpLink*> g_links_by_periodic_id; // 주기 DID 전용 CAN ID -> ISO-TP 채널
+uint32_t g_can_rx_drops = 0;                           // SO_RXQ_OVFL로 받은 누적 수신 유실 수
+GatewayMetrics g_metrics;
+TraceRing g_trace;
+FunctionalRequests g_functional;
+std::unordered_map<uint64_t, std::unique_ptr<DoipSession>> g_sessions;
+uint64_t g_next_session_id = 0;
 
 
 // *** --- 함수 프로토타입 --- ***
+bool load_config(const char* path, GatewayConfig& config);
+uint32_t parse_can_id(const std::string& text);
+IsoTpBackend parse_isotp_backend(const std::string& text);
+bool resolve_can_ifindex(int sock, int& ifindex);
 int setup_can_socket();
-void handle_doip_session(int client_sock);
-void can_to_doip_forwarder(int can_sock, int client_sock, std::atomic<bool>& session_active);
+int setup_isotp_socket(const IsoTpLink& link);
+int setup_listen_socket();
+void on_accept(int server_sock);
+void on_session_event(uint64_t session_id, uint32_t events);
+void on_can_readable();
+void close_session(uint64_t session_id);
+void handle_doip_message(DoipSession& session, uint16_t payload_type, const uint8_t* payload, uint32_t payload_length);
+void session_process_rx(DoipSession& session);
+void session_send(DoipSession& session, std::vector<uint8_t> msg, size_t offset = 0);
+void session_send_bytes(DoipSession& session, const uint8_t* data, size_t len);
+ssize_t session_try_send(DoipSession& session, const uint8_t* data, size_t len);
+void session_enqueue(DoipSession& session, TxChunk chunk);
+bool session_flush(DoipSession& session);
+std::vector<uint8_t> make_doip_message(uint16_t payload_type, uint32_t payload_length);
+void forward_response_to_tester(IsoTpLink& link, UdsMessage uds_response);
+
+// --- 요청 중재 관련 함수 ---
+void enqueue_request(IsoTpLink& link, uint64_t session_id, std::vector<uint8_t> uds_request);
+std::vector<uint8_t> request_buffer_acquire(IsoTpLink& link);
+void request_buffer_release(IsoTpLink& link, std::vector<uint8_t>& buffer);
+void queue_request(IsoTpLink& link, PendingRequest req);
+RequestPriority request_priority(const uint8_t* uds_request, size_t len);
+size_t queued_requests(const IsoTpLink& link);
+bool has_pending_request(const IsoTpLink& link, uint64_t session_id);
+void erase_pending_requests(IsoTpLink& link, uint64_t session_id, bool flash_only);
+bool request_queue_full(const IsoTpLink& link, const uint8_t* uds_request, size_t len);
+void dispatch_next_request(IsoTpLink& link);
+bool pop_next_request(IsoTpLink& link, PendingRequest& out);
+bool expects_response(const std::vector<uint8_t>& uds_request);
+
+// --- TesterPresent 대행 관련 함수 ---
+void keepalive_on_response(IsoTpLink& link, const UdsMessage& uds_response);
+bool keepalive_absorb(IsoTpLink& link, DoipSession& session, const std::vector<uint8_t>& uds_request);
+void keepalive_tick(IsoTpLink& link);
+bool keepalive_send(IsoTpLink& link);
+void keepalive_stop(IsoTpLink& link);
+
+// --- 기능 주소 요청 관련 함수 ---
+void functional_enqueue(DoipSession& session, std::vector<uint8_t> uds_request);
+bool functional_channels_idle();
+void functional_dispatch();
+void functional_on_response(const UdsMessage& uds_response);
+void functional_close_window();
+
+// --- RDBI 캐시 관련 함수 ---
+int did_cache_ttl(const IsoTpLink& link, const std::vector<uint8_t>& uds_request);
+bool did_cache_serve(IsoTpLink& link, DoipSession& session, const std::vector<uint8_t>& uds_request);
+void did_cache_on_request(IsoTpLink& link, const std::vector<uint8_t>& uds_request);
+void did_cache_on_response(IsoTpLink& link, const UdsMessage& uds_response);
+
+// --- 주기 DID(0x2A) 관련 함수 ---
+void periodic_on_response(IsoTpLink& link, const UdsMessage& uds_response);
+bool periodic_on_message(IsoTpLink& link, const uint8_t* data, size_t len);
+void periodic_flush(DoipSession& session);
+
+// --- 플래시 다운로드 가속 관련 함수 ---
+void flash_on_request_download(IsoTpLink& link, uint64_t session_id, const std::vector<uint8_t>& uds_request);
+void flash_on_download_accepted(IsoTpLink& link, const UdsMessage& uds_response);
+void flash_on_stream(DoipSession& session, const uint8_t* payload, uint32_t payload_length);
+void flash_on_ecu_response(IsoTpLink& link, UdsMessage uds_response);
+void flash_pump(IsoTpLink& link);
+void flash_arm_idle_timer(IsoTpLink& link);
+void flash_on_stream_idle(IsoTpLink& link);
+void flash_abort(IsoTpLink& link, uint8_t nack_code);
+void flash_reset(IsoTpLink& link);
+void session_set_rx_paused(DoipSession& session, bool paused);
+void session_update_events(DoipSession& session);
+void send_diagnostic_message(DoipSession& session, uint16_t source_address, const std::vector<uint8_t>& uds);
+void send_diagnostic_ack(DoipSession& session, uint16_t target_address);
+void send_diagnostic_nack(DoipSession& session, uint16_t target_address, uint8_t nack_code);
+void send_generic_nack(DoipSession& session, uint8_t nack_code);
+
+// --- 트레이스 관련 함수 ---
+void trace_init(size_t frames);
+void trace_can(const canfd_frame& frame, bool fd, TraceDirection direction);
+void trace_doip(uint64_t session_id, TraceDirection direction, const uint8_t* data, size_t len);
+void on_trace_signal(int signal_fd);
+bool trace_dump(const std::string& path, bool pcapng);
+
+// --- 메트릭 관련 함수 ---
+int setup_metrics_socket();
+void on_metrics_accept(int server_sock);
+void on_metrics_event(int fd, uint32_t events);
+void close_metrics_client(int fd);
+std::string render_metrics();
+
+// --- CAN 프레임 관련 함수 ---
+size_t isotp_tx_dl(const IsoTpLink& link);
+size_t can_prepare_frame(bool fd, canfd_frame& frame);
+size_t can_prepare_frame(const IsoTpLink& link, canfd_frame& frame);
+bool can_write_frame(bool fd, canfd_frame& frame);
+bool can_write_frame(const IsoTpLink& link, canfd_frame& frame);
 
 // --- ISO-TP 송신 관련 함수 ---
-bool isotp_send(int sock, uint32_t can_id, const std::vector<uint8_t>& data);
-bool isotp_send_single_frame(int sock, uint32_t can_id, const std::vector<uint8_t>& data); // ✨ 변경점
-void isotp_send_first_frame(int sock, uint32_t can_id, const std::vector<uint8_t>& data);
-bool isotp_send_multi_frame(int sock, uint32_t can_id, const std::vector<uint8_t>& data);
-bool isotp_send_consecutive_frames(int sock, uint32_t can_id, const std::vector<uint8_t>& data, size_t* bytes_sent, uint8_t* seq_num);
-bool wait_for_flow_control(can_frame& fc_frame);
+bool isotp_send(IsoTpLink& link, std::vector<uint8_t> data);
+bool isotp_send_single_frame(IsoTpLink& link, const std::vector<uint8_t>& data);
+bool isotp_send_first_frame(IsoTpLink& link, const std::vector<uint8_t>& data);
+void isotp_send_consecutive_frames(IsoTpLink& link);
+bool isotp_wait_until(IsoTpLink& link, Clock::time_point deadline);
+void isotp_wait_flow_control(IsoTpLink& link);
+void isotp_arm_fc_timeout(IsoTpLink& link);
+void isotp_on_flow_control(IsoTpLink& link, const canfd_frame& fc_frame);
+void isotp_finish_tx(IsoTpLink& link, bool ok);
+void response_timing_start(IsoTpLink& link);
+void response_timing_arm(IsoTpLink& link, int base_ms);
+void response_timing_on_pending(IsoTpLink& link);
+void response_timing_on_session(IsoTpLink& link, const UdsMessage& uds_response);
+void response_timing_expired(IsoTpLink& link);
+bool response_matches_inflight(const IsoTpLink& link, const UdsMessage& uds_response);
+bool isotp_kernel_send(IsoTpLink& link, const std::vector<uint8_t>& data);
+void on_isotp_socket_event(IsoTpLink& link, uint32_t events);
 
 // --- ISO-TP 수신 관련 함수 ---
-std::vector<uint8_t> isotp_receive(int sock);
-std::vector<uint8_t> isotp_handle_single_frame(const can_frame& frame);
-std::vector<uint8_t> isotp_handle_multi_frame(int sock, const can_frame& first_frame);
-void isotp_send_flow_control(int sock);
+void isotp_on_frame(IsoTpLink& link, const canfd_frame& frame);
+UdsMessage isotp_handle_single_frame(const canfd_frame& frame);
+void isotp_handle_first_frame(IsoTpLink& link, const canfd_frame& first_frame);
+void isotp_handle_consecutive_frame(IsoTpLink& link, const canfd_frame& cf_frame);
+void isotp_send_flow_control(IsoTpLink& link, uint8_t flow_status);
+void isotp_abort_rx(IsoTpLink& link, const char* reason);
+void isotp_arm_cf_timeout(IsoTpLink& link);
+void isotp_fc_backoff(IsoTpLink& link, const char* reason);
+void isotp_fc_on_success(IsoTpLink& link);
+void isotp_fc_apply(IsoTpLink& link);
+void isotp_fc_try_reopen(IsoTpLink& link);
+void on_can_rx_overflow(uint32_t dropped);
+void isotp_on_message(IsoTpLink& link, UdsMessage uds_response);
 
 // --- 메인 함수 ---
-int main() {
-    signal(SIGPIPE, SIG_IGN); // Ctrl+C 시그널 무시 (자식 프로세스가 아닌 메인 서버가 종료되도록)
+// 사용법: uds_gateway [설정 파일]  (예: resources/uds_gateway.conf)
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN); // 끊긴 진단기 소켓에 쓰다가 프로세스가 종료되지 않도록
+    signal(SIGCHLD, SIG_IGN); // 트레이스 덤프 자식 프로세스는 자동 회수
+    prctl(PR_SET_TIMERSLACK, 1UL); // timerfd 만료를 커널이 임의로 늦추지 않도록 (STmin 정확도)
+
+    if (argc > 1 && !load_config(argv[1], g_config)) return -1;
+    if (g_config.ecus.empty()) {
+        g_config.ecus.push_back(EcuConfig{ "TC375", SERVER_LOGICAL_ADDRESS, UDS_REQUEST_CAN_ID, UDS_RESPONSE_CAN_ID });
+    }
+    if (!g_reactor.init()) {
+        std::cerr << "epoll/timerfd 생성 실패." << std::endl; return -1;
+    }
+
+    // 트레이스 덤프 요청: SIGUSR1 = pcapng, SIGUSR2 = candump 로그 (signalfd로 리액터에서 처리)
+    int trace_signal_fd = -1;
+    if (g_config.trace_frames > 0) {
+        trace_init(g_config.trace_frames);
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        sigaddset(&signals, SIGUSR2);
+        sigprocmask(SIG_BLOCK, &signals, nullptr);
+        trace_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (trace_signal_fd >= 0) {
+            g_reactor.add(trace_signal_fd, EPOLLIN, [trace_signal_fd](uint32_t) { on_trace_signal(trace_signal_fd); });
+            std::cout << "트레이스: 최근 " << g_trace.slots.size() << "건 기록 중 (kill -USR1 " << getpid()
+                      << " → pcapng, -USR2 → candump 로그, " << g_config.trace_dir << ")" << std::endl;
+        }
+    }
 
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    for (const EcuConfig& ecu : g_config.ecus) {
+        IsoTpLink& link = g_links[ecu.logical_address];
+        link.cfg = ecu;
+        link.rx_fc_bs = ecu.fc_bs;
+        link.rx_fc_stmin = ecu.fc_adaptive ? ADAPTIVE_STMIN_STEPS[0] : ecu.fc_stmin;
+        link.p2_ms = ecu.p2_server_ms + P2_MARGIN_MS;
+        link.p2_star_ms = ecu.p2_star_server_ms + P2_MARGIN_MS;
+
+        // 커널 ISO-TP를 요청했지만 모듈이 없으면 유저스페이스 엔진으로 대체합니다.
+        if (ecu.backend == IsoTpBackend::KERNEL) {
+            link.isotp_sock = setup_isotp_socket(link);
+            if (link.isotp_sock < 0) {
+                std::cerr << ecu.name << ": CAN_ISOTP 소켓 생성 실패 (" << strerror(errno) << "). 유저스페이스 ISO-TP로 대체합니다." << std::endl;
+                link.cfg.backend = IsoTpBackend::USER;
+            }
+            else {
+                g_reactor.add(link.isotp_sock, EPOLLIN, [&link](uint32_t events) { on_isotp_socket_event(link, events); });
+            }
+        }
+        if (link.cfg.backend == IsoTpBackend::USER) g_links_by_rx_id[ecu.rx_id] = &link;
+        if (ecu.periodic_rx_id) g_links_by_periodic_id[ecu.periodic_rx_id] = &link;
+
+        std::cout << "라우팅: 0x" << std::hex << ecu.logical_address << " -> CAN 0x" << (ecu.tx_id & CAN_EFF_MASK)
+                  << "/0x" << (ecu.rx_id & CAN_EFF_MASK) << std::dec << " (" << ecu.name << ", "
+                  << (link.cfg.backend == IsoTpBackend::KERNEL ? "kernel" : "user") << " ISO-TP, FC "
+                  << (ecu.fc_adaptive ? "adaptive" : "fixed") << ", " << (ecu.can_fd ? "CAN FD" : "Classic CAN") << ")" << std::endl;
+    }
+
+    int server_sock = setup_listen_socket();
+    if (server_sock < 0) return -1;
+
+    g_can_sock = setup_can_socket();
+    if (g_can_sock < 0) {
+        std::cerr << "CAN 소켓 설정 실패." << std::endl; close(server_sock); return -1;
+    }
+    std::cout << "CAN 소켓이 성공적으로 설정되었습니다." << std::endl;
+
+    g_reactor.add(server_sock, EPOLLIN, [server_sock](uint32_t) { on_accept(server_sock); });
+    g_reactor.add(g_can_sock, EPOLLIN, [](uint32_t) { on_can_readable(); });
+
+    int metrics_sock = -1;
+    if (g_config.metrics_port > 0) {
+        metrics_sock = setup_metrics_socket();
+        if (metrics_sock < 0) {
+            std::cerr << "메트릭 소켓 설정 실패 (포트 " << g_config.metrics_port << "). 메트릭 없이 계속합니다." << std::endl;
+        }
+        else {
+            g_reactor.add(metrics_sock, EPOLLIN, [metrics_sock](uint32_t) { on_metrics_accept(metrics_sock); });
+            std::cout << "메트릭: http://127.0.0.1:" << g_config.metrics_port << "/metrics" << std::endl;
+        }
+    }
+
+    std::cout << "DoIP 게이트웨이 시작. 포트 " << g_config.doip_port << "에서 연결 대기 중..." << std::endl;
+    g_reactor.run();
+
+    if (metrics_sock >= 0) close(metrics_sock);
+    if (trace_signal_fd >= 0) close(trace_signal_fd);
+    close(g_can_sock);
+    close(server_sock);
+    return 0;
+}
+
+// --- 설정 파일 읽기 ---
+// 한 줄에 항목 하나, '#' 뒤는 주석입니다.
+//   interface can0
+//   port 13400
+//   gateway_address 0x1000
+//   isotp kernel|user
+//   stmin_spin_us 200
+//   periodic_flush_ms 10
+//   metrics_port 9400   (0 = 끔)
+//   trace_frames 16384  (0 = 끔)
+//   trace_dir /tmp
+//   functional_address 0xE400
+//   functional_tx 0x7DF
+//   functional_window_ms 100
+//   tester_present_ms 2000   (0 = 끔)
+//   ecu <이름> address=0x1000 tx=0x7E0 rx=0x7E8 [isotp=kernel|user] [bs=0] [stmin=0x0A] [fc=fixed|adaptive] [can=classic|fd]
+//       [periodic_rx=0x6E8] [queue=16] [p2=50] [p2star=5000]
+//   cache <ECU 이름> did=0xF190 ttl_ms=500   (ecu 줄 뒤에 둠)
+bool load_config(const char* path, GatewayConfig& config) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "설정 파일을 열 수 없습니다: " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        ++line_no;
+        line = line.substr(0, line.find('#'));
+        std::istringstream tokens(line);
+        std::string key;
+        if (!(tokens >> key)) continue;
+
+        try {
+            if (key == "interface") {
+                tokens >> config.can_interface;
+            }
+            else if (key == "port") {
+                std::string v; tokens >> v;
+                config.doip_port = std::stoi(v, nullptr, 0);
+            }
+            else if (key == "gateway_address") {
+                std::string v; tokens >> v;
+                config.gateway_address = std::stoul(v, nullptr, 0);
+            }
+            else if (key == "stmin_spin_us") {
+                std::string v; tokens >> v;
+                config.stmin_spin_us = std::stoi(v, nullptr, 0);
+            }
+            else if (key == "functional_address") {
+                std::string v; tokens >> v;
+                config.functional_address = std::stoul(v, nullptr, 0);
+            }
+            else if (key == "functional_tx") {
+                std::string v; tokens >> v;
+                config.functional_tx_id = parse_can_id(v);
+            }
+            else if (key == "functional_window_ms") {
+                std::string v; tokens >> v;
+                config.functional_window_ms = std::stoi(v, nullptr, 0);
+            }
+            else if (key == "tester_present_ms") {
+                std::string v; tokens >> v;
+                config.tester_present_ms = std::stoi(v, nullptr, 0);
+            }
+            else if (key == "trace_frames") {
+                std::string v; tokens >> v;
+                config.trace_frames = std::stoul(v, nullptr, 0);
+            }
+            else if (key == "trace_dir") {
+                tokens >> config.trace_dir;
+            }
+            else if (key == "log_messages") {
+                std::string v; tokens >> v;
+                if (v != "on" && v != "off") throw std::invalid_argument("log_messages on|off");
+                config.log_messages = v == "on";
+            }
+            else if (key == "metrics_port") {
+                std::string v; tokens >> v;
+                config.metrics_port = std::stoi(v, nullptr, 0);
+            }
+            else if (key == "periodic_flush_ms") {
+                std::string v; tokens >> v;
+                config.periodic_flush_ms = std::stoi(v, nullptr, 0);
+            }
+            else if (key == "isotp") {
+                std::string v; tokens >> v;
+                config.isotp_backend = parse_isotp_backend(v);
+            }
+            else if (key == "ecu") {
+                EcuConfig ecu;
+                ecu.backend = config.isotp_backend;
+                if (!(tokens >> ecu.name)) throw std::invalid_argument("ECU 이름 없음");
+                std::string option;
+                while (tokens >> option) {
+                    size_t eq = option.find('=');
+                    if (eq == std::string::npos) throw std::invalid_argument(option);
+                    std::string name = option.substr(0, eq);
+                    std::string value = option.substr(eq + 1);
+                    if (name == "address") ecu.logical_address = std::stoul(value, nullptr, 0);
+                    else if (name == "tx") ecu.tx_id = parse_can_id(value);
+                    else if (name == "rx") ecu.rx_id = parse_can_id(value);
+                    else if (name == "isotp") ecu.backend = parse_isotp_backend(value);
+                    else if (name == "bs") ecu.fc_bs = std::stoul(value, nullptr, 0);
+                    else if (name == "stmin") ecu.fc_stmin = std::stoul(value, nullptr, 0);
+                    else if (name == "fc" && (value == "adaptive" || value == "fixed")) ecu.fc_adaptive = (value == "adaptive");
+                    else if (name == "can" && (value == "fd" || value == "classic")) ecu.can_fd = (value == "fd");
+                    else if (name == "periodic_rx") ecu.periodic_rx_id = parse_can_id(value);
+                    else if (name == "queue") ecu.queue_limit = std::stoi(value, nullptr, 0);
+                    else if (name == "p2") { ecu.p2_server_ms = std::stoi(value, nullptr, 0); ecu.timing_fixed = true; }
+                    else if (name == "p2star") { ecu.p2_star_server_ms = std::stoi(value, nullptr, 0); ecu.timing_fixed = true; }
+                    else throw std::invalid_argument(option);
+                }
+                if (ecu.logical_address == 0 || ecu.tx_id == 0 || ecu.rx_id == 0) {
+                    throw std::invalid_argument("address/tx/rx 누락");
+                }
+                if (ecu.queue_limit < 1) throw std::invalid_argument("queue는 1 이상");
+                if (ecu.logical_address == config.functional_address) {
+                    throw std::invalid_argument("기능 주소와 같은 ECU 주소: " + ecu.name);
+                }
+                for (const EcuConfig& other : config.ecus) {
+                    if (other.logical_address == ecu.logical_address || other.rx_id == ecu.rx_id ||
+                        (ecu.periodic_rx_id && (ecu.periodic_rx_id == other.rx_id || ecu.periodic_rx_id == other.periodic_rx_id)) ||
+                        (other.periodic_rx_id && other.periodic_rx_id == ecu.rx_id)) {
+                        throw std::invalid_argument("중복된 주소 또는 응답 ID: " + ecu.name);
+                    }
+                }
+                config.ecus.push_back(ecu);
+            }
+            else if (key == "cache") {
+                std::string ecu_name, did_option, ttl_option;
+                if (!(tokens >> ecu_name >> did_option >> ttl_option) ||
+                    did_option.compare(0, 4, "did=") != 0 || ttl_option.compare(0, 7, "ttl_ms=") != 0) {
+                    throw std::invalid_argument("cache <ECU 이름> did=<DID> ttl_ms=<ms>");
+                }
+                auto ecu = std::find_if(config.ecus.begin(), config.ecus.end(),
+                                        [&ecu_name](const EcuConfig& e) { return e.name == ecu_name; });
+                if (ecu == config.ecus.end()) throw std::invalid_argument("알 수 없는 ECU: " + ecu_name);
+                uint16_t did = std::stoul(did_option.substr(4), nullptr, 0);
+                ecu->did_cache_ttl_ms[did] = std::stoi(ttl_option.substr(7), nullptr, 0);
+            }
+            else {
+                throw std::invalid_argument(key);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "설정 파일 오류 (" << path << ":" << line_no << "): " << e.what() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// 0x7FF보다 큰 ID는 29비트 확장 ID로 취급합니다.
+uint32_t parse_can_id(const std::string& text) {
+    uint32_t id = std::stoul(text, nullptr, 0);
+    if (id > CAN_EFF_MASK) throw std::invalid_argument("CAN ID 범위 초과: " + text);
+    return (id > CAN_SFF_MASK) ? (id | CAN_EFF_FLAG) : id;
+}
+
+IsoTpBackend parse_isotp_backend(const std::string& text) {
+    if (text == "kernel") return IsoTpBackend::KERNEL;
+    if (text == "user") return IsoTpBackend::USER;
+    throw std::invalid_argument("isotp는 kernel 또는 user: " + text);
+}
+
+// --- TCP 리슨 소켓 설정 함수 ---
+int setup_listen_socket() {
+    int server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_sock == -1) {
         std::cerr << "TCP 소켓 생성 실패." << std::endl; return -1;
     }
@@ -78,478 +1005,2340 @@ int main() {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(DOIP_PORT);
+    server_addr.sin_port = htons(g_config.doip_port);
 
     if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
         std::cerr << "TCP 바인딩 실패." << std::endl; close(server_sock); return -1;
     }
 
-    if (listen(server_sock, 5) == -1) {
-        std::cerr << "TCP 리슨 실패." << std::endl; close(server_sock); return -1;
+    if (listen(server_sock, 5) == -1) {
+        std::cerr << "TCP 리슨 실패." << std::endl; close(server_sock); return -1;
+    }
+    return server_sock;
+}
+
+// --- 신규 진단기 연결 수락 ---
+void on_accept(int server_sock) {
+    while (true) {
+        int client_sock = accept4(server_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "클라이언트 연결 수락 실패." << std::endl;
+            return;
+        }
+
+        if ((int)g_sessions.size() >= MAX_DOIP_SESSIONS) {
+            std::cerr << "동시 세션 한도(" << MAX_DOIP_SESSIONS << ") 초과. 연결 거부." << std::endl;
+            g_metrics.sessions_rejected++;
+            close(client_sock);
+            continue;
+        }
+
+        int nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        auto session = std::make_unique<DoipSession>();
+        session->id = ++g_next_session_id;
+        session->fd = client_sock;
+        uint64_t sid = session->id;
+        g_sessions[sid] = std::move(session);
+        g_metrics.sessions_accepted++;
+
+        g_reactor.add(client_sock, EPOLLIN | EPOLLRDHUP, [sid](uint32_t events) { on_session_event(sid, events); });
+        std::cout << "\n진단기 클라이언트 연결됨. 세션 #" << sid << " 시작 (동시 세션 " << g_sessions.size() << "개)." << std::endl;
+    }
+}
+
+// --- 세션 종료 및 정리 ---
+void close_session(uint64_t session_id) {
+    auto it = g_sessions.find(session_id);
+    if (it == g_sessions.end()) return;
+
+    g_reactor.remove(it->second->fd);
+    g_reactor.cancel_timer(it->second->periodic_timer);
+    close(it->second->fd);
+    g_sessions.erase(it);
+
+    auto& functional = g_functional.pending;
+    functional.erase(std::remove_if(functional.begin(), functional.end(),
+                                    [session_id](const PendingRequest& r) { return r.session_id == session_id; }),
+                     functional.end());
+
+    // 이 세션이 남긴 대기 요청은 버리고, 진행 중인 응답은 받을 곳이 없어짐
+    // (예약한 주기 DID는 ECU가 S3 타임아웃으로 세션을 끝낼 때 멈추므로 여기선 전달만 끊음)
+    for (auto& entry : g_links) {
+        IsoTpLink& link = entry.second;
+        erase_pending_requests(link, session_id, false);
+        if (link.owner_session == session_id) link.owner_session = 0;
+        if (link.flash.session_id == session_id) flash_reset(link);
+        if (link.keepalive_session == session_id) keepalive_stop(link); // ECU는 S3 타임아웃 뒤 기본 세션으로 돌아감
+        for (auto p = link.periodic_owner.begin(); p != link.periodic_owner.end();) {
+            p = (p->second == session_id) ? link.periodic_owner.erase(p) : std::next(p);
+        }
+    }
+
+    std::cout << "클라이언트 세션 #" << session_id << " 종료." << std::endl;
+}
+
+// --- 진단기 소켓 이벤트 처리 (DoIP -> CAN 방향) ---
+void on_session_event(uint64_t session_id, uint32_t events) {
+    auto it = g_sessions.find(session_id);
+    if (it == g_sessions.end()) return;
+    DoipSession& session = *it->second;
+
+    if (events & EPOLLERR) {
+        close_session(session_id);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && !session_flush(session)) {
+        close_session(session_id);
+        return;
+    }
+
+    bool readable = (events & (EPOLLRDHUP | EPOLLHUP)) || ((events & EPOLLIN) && !session.rx_paused);
+    if (readable) {
+        // 수신 버퍼 빈 자리에 바로 읽고, 읽을 때마다 완성된 메시지를 처리합니다.
+        // (플래시 스트림으로 읽기가 멈추면 남은 바이트는 소켓에 둔 채 다음 이벤트를 기다림)
+        bool hangup = events & (EPOLLRDHUP | EPOLLHUP);
+        while (!session.closing && (!session.rx_paused || hangup)) {
+            uint8_t* dst = session.rx.prepare(session.rx_need);
+            ssize_t n = read(session.fd, dst, session.rx.writable());
+            if (n > 0) {
+                g_metrics.doip_rx_bytes += n;
+                session.rx.commit(n);
+                session_process_rx(session);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            session.closing = true; // 0 = 진단기 연결 끊김, 그 외 = 읽기 오류
+            break;
+        }
+    }
+
+    if (session.closing) close_session(session_id);
+}
+
+// 버퍼에 완성된 DoIP 메시지를 순서대로 처리합니다 (짧은 읽기는 다음 read()에서 이어 붙임).
+void session_process_rx(DoipSession& session) {
+    RxBuffer& rx = session.rx;
+    session.rx_need = 0;
+    while (!session.closing) {
+        if (session.rx_discard > 0) {
+            size_t n = std::min(session.rx_discard, rx.size());
+            rx.consume(n);
+            session.rx_discard -= n;
+            if (session.rx_discard > 0) return;
+        }
+        if (rx.size() < sizeof(DoIPHeader)) return;
+
+        DoIPHeader header;
+        memcpy(&header, rx.data(), sizeof(header));
+        uint32_t payload_length = ntohl(header.payload_length);
+        uint16_t payload_type = ntohs(header.payload_type);
+
+        // 헤더 검사 실패는 Generic DoIP header NACK(0x0000)으로 알립니다.
+        if (header.inverse_version != (uint8_t)~header.version) {
+            std::cerr << "잘못된 DoIP 헤더 패턴. 연결을 끊습니다." << std::endl;
+            send_generic_nack(session, 0x00); // 0x00: Incorrect pattern format
+            session.closing = true;
+            return;
+        }
+        if (payload_length > MAX_DOIP_PAYLOAD_LENGTH) {
+            std::cerr << "DoIP 페이로드 길이가 비정상입니다. (" << payload_length << " 바이트)" << std::endl;
+            send_generic_nack(session, 0x02); // 0x02: Message too large (메시지는 버리고 연결은 유지)
+            rx.consume(sizeof(DoIPHeader));
+            session.rx_discard = payload_length;
+            continue;
+        }
+        size_t message_length = sizeof(DoIPHeader) + payload_length;
+        if (rx.size() < message_length) {
+            session.rx_need = message_length;
+            return;
+        }
+
+        trace_doip(session.id, TRACE_RX, rx.data(), message_length);
+        handle_doip_message(session, payload_type, rx.data() + sizeof(DoIPHeader), payload_length);
+        rx.consume(message_length);
+    }
+}
+
+void handle_doip_message(DoipSession& session, uint16_t payload_type, const uint8_t* payload, uint32_t payload_length) {
+    if (payload_type == 0x0005) { // 라우팅 활성화 요청
+        // [SA 2][활성화 타입 1][예약 4]([OEM 4])
+        if (payload_length != 7 && payload_length != 11) {
+            send_generic_nack(session, 0x04); // 0x04: Invalid payload length
+            session.closing = true;
+            return;
+        }
+        session.tester_address = (payload[0] << 8) | payload[1];
+        session.routing_active = true;
+        std::cout << "라우팅 활성화 요청 수신 (세션 #" << session.id << "). 긍정 응답 전송." << std::endl;
+        uint8_t resp[sizeof(ROUTING_ACTIVATION_RESPONSE_TEMPLATE)];
+        memcpy(resp, ROUTING_ACTIVATION_RESPONSE_TEMPLATE, sizeof(resp));
+        put_be16(resp + sizeof(DoIPHeader), session.tester_address);        // 클라이언트 주소
+        put_be16(resp + sizeof(DoIPHeader) + 2, g_config.gateway_address);  // 게이트웨이(DoIP 엔티티) 주소 (코드 0x10: 활성화됨)
+        session_send_bytes(session, resp, sizeof(resp));
+        return;
+    }
+
+    if (payload_type == 0x0007) { // Alive check 요청: 진단기 주소를 담아 0x0008로 응답
+        uint8_t resp[sizeof(ALIVE_CHECK_RESPONSE_TEMPLATE)];
+        memcpy(resp, ALIVE_CHECK_RESPONSE_TEMPLATE, sizeof(resp));
+        put_be16(resp + sizeof(DoIPHeader), session.tester_address);
+        session_send_bytes(session, resp, sizeof(resp));
+        return;
+    }
+    if (payload_type == 0x0008) return; // 게이트웨이는 alive check를 먼저 보내지 않으므로 무시
+
+    if (payload_type == DOIP_TYPE_FLASH_STREAM) {
+        flash_on_stream(session, payload, payload_length);
+        return;
+    }
+
+    if (payload_type != 0x8001) {
+        send_generic_nack(session, 0x01); // 0x01: Unknown payload type
+        return;
+    }
+    if (payload_length <= 4) { // SA/TA 뒤에 UDS 데이터가 없음
+        send_generic_nack(session, 0x04);
+        session.closing = true;
+        return;
+    }
+
+    // 라우팅 테이블에서 타깃 주소(TA)에 해당하는 ECU 채널을 찾습니다.
+    uint16_t source_address = (payload[0] << 8) | payload[1];
+    uint16_t target_address = (payload[2] << 8) | payload[3];
+    if (!session.routing_active || source_address != session.tester_address) {
+        std::cerr << "DoIP: 라우팅 활성화되지 않은 소스 주소 0x" << std::hex << source_address << std::dec << ". NACK (0x8003) 전송" << std::endl;
+        send_diagnostic_nack(session, target_address, 0x02); // 0x02: Invalid source address
+        return;
+    }
+    if (target_address == g_config.functional_address) {
+        // 기능 주소 요청은 SF 하나로만 보낼 수 있음 (ISO 15765-2)
+        if (payload_length - 4 > 7) {
+            send_diagnostic_nack(session, target_address, 0x04); // 0x04: Diagnostic message too large
+            return;
+        }
+        if (g_functional.pending.size() >= (size_t)REQUEST_QUEUE_LIMIT) {
+            send_diagnostic_nack(session, target_address, 0x05); // 0x05: Out of memory
+            return;
+        }
+        send_diagnostic_ack(session, target_address);
+        if (g_config.log_messages) std::cout << "\n[DoIP -> CAN] 세션 #" << session.id << " 기능 주소 UDS 요청 수신 (" << payload_length - 4 << " 바이트)" << std::endl;
+        functional_enqueue(session, std::vector<uint8_t>(payload + 4, payload + payload_length));
+        return;
+    }
+
+    auto link_it = g_links.find(target_address);
+    bool known_target = link_it != g_links.end();
+
+    // 막혀 기다리게 하지 않고 바로 거절해 진단기가 재시도하도록 합니다.
+    if (known_target && request_queue_full(link_it->second, payload + 4, payload_length - 4)) {
+        link_it->second.queue_rejects++;
+        std::cerr << "DoIP: " << link_it->second.cfg.name << " 요청 대기열이 가득 참. NACK (0x8003, 0x05) 전송" << std::endl;
+        send_diagnostic_nack(session, target_address, 0x05); // 0x05: Out of memory
+        return;
+    }
+
+    // DoIP ACK(0x8002) 또는 NACK(0x8003) 전송
+    if (known_target) {
+        send_diagnostic_ack(session, target_address);
+    }
+    else {
+        send_diagnostic_nack(session, target_address, 0x03); // 0x03: Unknown target address
+    }
+
+    if (!known_target) {
+        std::cerr << "\nDoIP: 알 수 없는 타깃 주소 0x" << std::hex << target_address << std::dec << ". NACK (0x8003) 전송" << std::endl;
+        return;
+    }
+    if (g_config.log_messages) std::cout << "\nDoIP: Positive ACK (0x8002) 전송 완료" << std::endl; // 확인용 로그
+
+    // DoIP 페이로드에서 SA, TA를 제외한 순수 UDS 데이터 추출 (수신 버퍼는 다음 read()가 덮어쓰므로 한 번 복사)
+    std::vector<uint8_t> uds_request = request_buffer_acquire(link_it->second);
+    uds_request.assign(payload + 4, payload + payload_length);
+    link_it->second.metrics.requests_by_sid[uds_request[0]]++;
+    if (g_config.log_messages) {
+        std::cout << "\n[DoIP -> CAN] 세션 #" << session.id << " -> " << link_it->second.cfg.name
+                  << " UDS 요청 수신 (" << uds_request.size() << " 바이트)" << std::endl;
+    }
+
+    if (keepalive_absorb(link_it->second, session, uds_request) || did_cache_serve(link_it->second, session, uds_request)) {
+        request_buffer_release(link_it->second, uds_request);
+        return;
+    }
+    if (uds_request[0] == 0x34) flash_on_request_download(link_it->second, session.id, uds_request);
+    enqueue_request(link_it->second, session.id, std::move(uds_request));
+}
+
+// --- DoIP 메시지 버퍼 생성 (헤더만 채우고 페이로드는 호출자가 채움) ---
+std::vector<uint8_t> make_doip_message(uint16_t payload_type, uint32_t payload_length) {
+    std::vector<uint8_t> msg(sizeof(DoIPHeader) + payload_length);
+    DoIPHeader* header = (DoIPHeader*)msg.data();
+    header->version = 2;
+    header->inverse_version = ~2;
+    header->payload_type = htons(payload_type);
+    header->payload_length = htonl(payload_length);
+    return msg;
+}
+
+// --- 진단기 소켓 쓰기 (막히면 큐에 보관 후 EPOLLOUT에서 이어서 전송) ---
+// 읽기 일시정지 여부와 송신 대기열에 맞춰 epoll 관심 이벤트를 다시 설정합니다.
+void session_update_events(DoipSession& session) {
+    uint32_t events = EPOLLRDHUP;
+    if (!session.rx_paused) events |= EPOLLIN;
+    if (!session.tx_queue.empty()) events |= EPOLLOUT;
+    g_reactor.modify(session.fd, events);
+}
+
+void session_set_rx_paused(DoipSession& session, bool paused) {
+    if (session.rx_paused == paused) return;
+    session.rx_paused = paused;
+    session_update_events(session);
+}
+
+// 대기열이 비어 있으면 바로 보내 보고, 남은 부분만 대기열에 넣습니다. (offset: msg 중 보낼 시작 위치)
+// 반환값: 바로 보낸 바이트 수, 소켓 오류면 -1
+ssize_t session_try_send(DoipSession& session, const uint8_t* data, size_t len) {
+    if (session.closing) return -1;
+    if (!session.tx_queue.empty()) return 0;
+
+    ssize_t n = send(session.fd, data, len, MSG_NOSIGNAL);
+    if (n >= 0) {
+        g_metrics.doip_tx_bytes += n;
+        return n;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+    std::cerr << "[CAN->DoIP] 세션 #" << session.id << " 소켓 쓰기 실패." << std::endl;
+    session.closing = true;
+    shutdown(session.fd, SHUT_RDWR); // 세션 핸들러가 HUP을 받아 정리
+    return -1;
+}
+
+void session_enqueue(DoipSession& session, TxChunk chunk) {
+    session.tx_backlog += chunk.data.size() - chunk.offset;
+    session.tx_queue.push_back(std::move(chunk));
+    if (session.tx_queue.size() == 1) session_update_events(session); // 소켓이 다시 쓸 수 있게 되면 EPOLLOUT으로 이어서 보냄
+    if (session.tx_backlog > MAX_SESSION_TX_BACKLOG) {
+        std::cerr << "세션 #" << session.id << " 송신 적체 한도 초과. 연결을 끊습니다." << std::endl;
+        session.closing = true;
+        shutdown(session.fd, SHUT_RDWR);
+    }
+}
+
+void session_send(DoipSession& session, std::vector<uint8_t> msg, size_t offset) {
+    trace_doip(session.id, TRACE_TX, msg.data() + offset, msg.size() - offset);
+    ssize_t n = session_try_send(session, msg.data() + offset, msg.size() - offset);
+    if (n < 0 || offset + n == msg.size()) return;
+    session_enqueue(session, TxChunk{ std::move(msg), offset + n });
+}
+
+// 고정 길이 응답용: 스택 버퍼를 그대로 보내고, 못 보낸 나머지만 힙에 복사해 대기열에 넣습니다.
+void session_send_bytes(DoipSession& session, const uint8_t* data, size_t len) {
+    trace_doip(session.id, TRACE_TX, data, len);
+    ssize_t n = session_try_send(session, data, len);
+    if (n < 0 || (size_t)n == len) return;
+    session_enqueue(session, TxChunk{ std::vector<uint8_t>(data + n, data + len), 0 });
+}
+
+// 대기열에 쌓인 메시지를 writev(sendmsg) 한 번에 최대 SESSION_TX_IOV_MAX개씩 묶어 보냅니다.
+bool session_flush(DoipSession& session) {
+    while (!session.tx_queue.empty()) {
+        iovec iov[SESSION_TX_IOV_MAX];
+        int iov_count = 0;
+        for (auto it = session.tx_queue.begin(); it != session.tx_queue.end() && iov_count < SESSION_TX_IOV_MAX; ++it) {
+            iov[iov_count].iov_base = it->data.data() + it->offset;
+            iov[iov_count].iov_len = it->data.size() - it->offset;
+            ++iov_count;
+        }
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        ssize_t n = sendmsg(session.fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        session.tx_backlog -= n;
+        g_metrics.doip_tx_bytes += n;
+        while (n > 0) {
+            TxChunk& front = session.tx_queue.front();
+            size_t left = front.data.size() - front.offset;
+            if ((size_t)n < left) {
+                front.offset += n;
+                break;
+            }
+            n -= left;
+            session.tx_queue.pop_front();
+        }
+    }
+    session_update_events(session);
+    return true;
+}
+
+// --- CAN 소켓 수신 처리 (CAN -> DoIP 방향) ---
+void on_can_readable() {
+    while (true) {
+        canfd_frame rx_frame;
+        char ctrl[CMSG_SPACE(sizeof(uint32_t))];
+        iovec iov = { &rx_frame, sizeof(rx_frame) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        ssize_t bytes_read = recvmsg(g_can_sock, &msg, 0);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("CAN read");
+            return;
+        }
+        if (bytes_read != CAN_MTU && bytes_read != CANFD_MTU) continue; // Classic 프레임은 len이 can_dlc와 같은 자리
+        trace_can(rx_frame, bytes_read == CANFD_MTU, TRACE_RX);
+
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                if (drops != g_can_rx_drops) {
+                    on_can_rx_overflow(drops - g_can_rx_drops);
+                    g_can_rx_drops = drops;
+                }
+            }
+        }
+
+        uint32_t can_id = rx_frame.can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+        auto it = g_links_by_rx_id.find(can_id);
+        if (it != g_links_by_rx_id.end()) {
+            isotp_on_frame(*it->second, rx_frame);
+            continue;
+        }
+        // 주기 DID 전용 ID의 프레임은 PCI 없이 [pDID][데이터]만 담음 (ISO 14229-2 type 2)
+        it = g_links_by_periodic_id.find(can_id);
+        if (it != g_links_by_periodic_id.end() && rx_frame.len > 0) {
+            periodic_on_message(*it->second, rx_frame.data, rx_frame.len);
+        }
+    }
+}
+
+// --- 게이트웨이가 직접 만든 진단 메시지/NACK 전송 ---
+void send_diagnostic_message(DoipSession& session, uint16_t source_address, const std::vector<uint8_t>& uds) {
+    std::vector<uint8_t> msg = make_doip_message(0x8001, 4 + uds.size());
+    uint8_t* p = msg.data() + sizeof(DoIPHeader);
+    uint16_t sa = htons(source_address);
+    uint16_t ta = htons(session.tester_address);
+    memcpy(p, &sa, 2);
+    memcpy(p + 2, &ta, 2);
+    memcpy(p + 4, uds.data(), uds.size());
+    session_send(session, std::move(msg));
+}
+
+void send_diagnostic_ack(DoipSession& session, uint16_t target_address) {
+    uint8_t ack[sizeof(DIAGNOSTIC_ACK_TEMPLATE)];
+    memcpy(ack, DIAGNOSTIC_ACK_TEMPLATE, sizeof(ack));
+    put_be16(ack + sizeof(DoIPHeader), target_address);             // 요청을 받은 주체 (ECU)
+    put_be16(ack + sizeof(DoIPHeader) + 2, session.tester_address); // 요청을 보낸 주체 (진단기)
+    session_send_bytes(session, ack, sizeof(ack));
+}
+
+void send_diagnostic_nack(DoipSession& session, uint16_t target_address, uint8_t nack_code) {
+    uint8_t msg[sizeof(DIAGNOSTIC_ACK_TEMPLATE)];
+    memcpy(msg, DIAGNOSTIC_ACK_TEMPLATE, sizeof(msg));
+    msg[3] = 0x03; // 0x8003
+    put_be16(msg + sizeof(DoIPHeader), target_address);
+    put_be16(msg + sizeof(DoIPHeader) + 2, session.tester_address);
+    msg[sizeof(DoIPHeader) + 4] = nack_code;
+    session_send_bytes(session, msg, sizeof(msg));
+}
+
+void send_generic_nack(DoipSession& session, uint8_t nack_code) {
+    uint8_t msg[sizeof(GENERIC_NACK_TEMPLATE)];
+    memcpy(msg, GENERIC_NACK_TEMPLATE, sizeof(msg));
+    msg[sizeof(DoIPHeader)] = nack_code;
+    session_send_bytes(session, msg, sizeof(msg));
+}
+
+// --- ECU 응답을 DoIP 진단 메시지로 감싸 요청 세션에 전달 ---
+void forward_response_to_tester(IsoTpLink& link, UdsMessage uds_response) {
+    if (g_config.log_messages) std::cout << "[CAN -> DoIP] " << link.cfg.name << "로부터 UDS 데이터 수신 (" << uds_response.size() << " 바이트)" << std::endl;
+
+    auto it = g_sessions.find(link.owner_session);
+    if (it == g_sessions.end()) {
+        std::cerr << "[CAN -> DoIP] 응답을 전달할 세션이 없어 폐기합니다." << std::endl;
+        return;
+    }
+    DoipSession& session = *it->second;
+    if (!session.periodic_batch.empty()) periodic_flush(session); // 앞서 받은 주기 레코드가 먼저 가도록
+
+    // UDS 표준 응답 SID는 긍정 응답(0x40~0x7E)과 부정 응답(0x7F)을 포함합니다.
+    // 첫 바이트가 이 범위에 속하지 않으면 (예: DID로 시작하는 주기적 데이터)
+    // 진단 라이브러리가 인식할 수 있도록 0x62(RDBI 긍정 응답)를 붙여줍니다.
+    uint8_t first_byte = uds_response[0];
+    bool needs_prefix = !(first_byte >= 0x40 && first_byte <= 0x7F);
+    if (needs_prefix) {
+        if (g_config.log_messages) std::cout << "[Gateway] 비표준 응답을 정식 UDS 응답(0x62)으로 변환합니다." << std::endl;
+    }
+
+    // 재조립 버퍼 앞쪽 여유 공간에 헤더를 채우고 버퍼째 넘깁니다.
+    // 접두어가 없으면 여유 공간의 첫 바이트는 쓰지 않으므로 offset 1부터 보냅니다.
+    size_t uds_size = uds_response.size() + (needs_prefix ? 1 : 0);
+    size_t start = needs_prefix ? 0 : 1;
+    uint8_t* p = uds_response.buf.data() + start;
+    DoIPHeader header;
+    header.version = 2;
+    header.inverse_version = ~2;
+    header.payload_type = htons(0x8001);
+    header.payload_length = htonl(4 + uds_size);
+    memcpy(p, &header, sizeof(header));
+    put_be16(p + sizeof(DoIPHeader), link.cfg.logical_address);
+    put_be16(p + sizeof(DoIPHeader) + 2, session.tester_address);
+    if (needs_prefix) p[sizeof(DoIPHeader) + 4] = 0x62; // ReadDataByIdentifier Positive Response
+
+    session_send(session, std::move(uds_response.buf), start);
+}
+
+// --- 트레이스 링 ---
+void trace_init(size_t frames) {
+    size_t size = 1;
+    while (size < frames) size <<= 1;
+    g_trace.slots.assign(size, TraceRecord());
+}
+
+void trace_can(const canfd_frame& frame, bool fd, TraceDirection direction) {
+    TraceRecord* r = g_trace.claim();
+    if (!r) return;
+    r->kind = TRACE_CAN;
+    r->direction = direction;
+    r->id = frame.can_id;
+    r->flags = fd ? (frame.flags | CANFD_FDF) : 0;
+    r->captured = std::min<size_t>(frame.len, TRACE_SNAPLEN);
+    r->length = frame.len;
+    memcpy(r->data, frame.data, r->captured);
+}
+
+// data에 이어 붙은 DoIP 메시지를 하나씩 기록합니다 (주기 DID 묶음처럼 한 버퍼에 여러 개일 수 있음).
+void trace_doip(uint64_t session_id, TraceDirection direction, const uint8_t* data, size_t len) {
+    if (g_trace.slots.empty()) return;
+    while (len >= sizeof(DoIPHeader)) {
+        uint32_t payload_length;
+        memcpy(&payload_length, data + 4, 4);
+        size_t message_length = sizeof(DoIPHeader) + ntohl(payload_length);
+        TraceRecord* r = g_trace.claim();
+        r->kind = TRACE_DOIP;
+        r->direction = direction;
+        r->id = session_id;
+        r->flags = 0;
+        r->captured = std::min(std::min(message_length, len), TRACE_SNAPLEN);
+        r->length = message_length;
+        memcpy(r->data, data, r->captured);
+        if (message_length >= len) break;
+        data += message_length;
+        len -= message_length;
+    }
+}
+
+void on_trace_signal(int signal_fd) {
+    signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        bool pcapng = info.ssi_signo == SIGUSR1;
+        std::string path = g_config.trace_dir + "/uds_gateway_" + std::to_string(time(nullptr)) + "_" +
+                           std::to_string(g_trace.next) + (pcapng ? ".pcapng" : ".log");
+        // 자식은 fork 시점의 링을 그대로 보므로 부모는 파일 쓰기를 기다리지 않고 계속 기록합니다.
+        pid_t pid = fork();
+        if (pid == 0) _exit(trace_dump(path, pcapng) ? 0 : 1);
+        if (pid < 0) std::cerr << "트레이스 덤프 fork 실패: " << strerror(errno) << std::endl;
+        else std::cout << "트레이스 덤프: " << path << std::endl;
+    }
+}
+
+namespace {
+void append_u16(std::string& out, uint16_t v) { out.append((const char*)&v, 2); }
+void append_u32(std::string& out, uint32_t v) { out.append((const char*)&v, 4); }
+void append_padded(std::string& out, const void* data, size_t len) {
+    out.append((const char*)data, len);
+    out.append((4 - len % 4) % 4, '\0');
+}
+void append_option(std::string& out, uint16_t code, const void* data, size_t len) {
+    append_u16(out, code);
+    append_u16(out, len);
+    append_padded(out, data, len);
+}
+// pcapng 블록: [타입][전체 길이][본문(4바이트 정렬)][전체 길이], 정수는 호스트 바이트 순서
+void append_block(std::string& out, uint32_t type, const std::string& body) {
+    append_u32(out, type);
+    append_u32(out, 12 + body.size());
+    out += body;
+    append_u32(out, 12 + body.size());
+}
+} // namespace
+
+// pcapng: 인터페이스 0 = CAN (LINKTYPE_CAN_SOCKETCAN), 1 = DoIP (LINKTYPE_WIRESHARK_UPPER_PDU, "doip" 디섹터)
+// candump 로그: CAN 프레임만 "(초.마이크로초) can0 7E0#0322F190" 형식으로 씁니다.
+bool trace_dump(const std::string& path, bool pcapng) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) return false;
+
+    int64_t realtime_offset_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch() - Clock::now().time_since_epoch()).count();
+    const size_t size = g_trace.slots.size();
+    uint64_t first = g_trace.next > size ? g_trace.next - size : 0;
+
+    std::string buf;
+    if (pcapng) {
+        std::string body;
+        append_u32(body, 0x1A2B3C4D);           // byte-order magic
+        append_u16(body, 1);
+        append_u16(body, 0);
+        append_u32(body, 0xFFFFFFFF);           // section length: 모름
+        append_u32(body, 0xFFFFFFFF);
+        append_block(buf, 0x0A0D0D0A, body);    // Section Header Block
+
+        const uint8_t tsresol = 9;              // 나노초
+        const std::pair<uint16_t, std::string> interfaces[] = { { 227, g_config.can_interface }, { 252, "doip" } };
+        for (const auto& iface : interfaces) {
+            body.clear();
+            append_u16(body, iface.first);
+            append_u16(body, 0);
+            append_u32(body, 0);                // snaplen: 제한 없음
+            append_option(body, 2, iface.second.data(), iface.second.size()); // if_name
+            append_option(body, 9, &tsresol, 1);                             // if_tsresol
+            append_u32(body, 0);                                              // opt_endofopt
+            append_block(buf, 1, body);         // Interface Description Block
+        }
+    }
+
+    char line[256];
+    for (uint64_t seq = first; seq < g_trace.next; ++seq) {
+        const TraceRecord& r = g_trace.slots[seq & (size - 1)];
+        uint64_t ts = r.timestamp_ns + realtime_offset_ns;
+        if (!pcapng) {
+            if (r.kind != TRACE_CAN) continue;
+            bool eff = r.id & CAN_EFF_FLAG;
+            bool fd = r.flags & CANFD_FDF;
+            int n = snprintf(line, sizeof(line), eff ? "(%llu.%06llu) %s %08X#" : "(%llu.%06llu) %s %03X#",
+                             (unsigned long long)(ts / 1000000000), (unsigned long long)(ts % 1000000000 / 1000),
+                             g_config.can_interface.c_str(), r.id & (eff ? CAN_EFF_MASK : CAN_SFF_MASK));
+            if (fd) n += snprintf(line + n, sizeof(line) - n, "#%X", r.flags & (CANFD_BRS | CANFD_ESI));
+            for (int i = 0; i < r.captured; ++i) n += snprintf(line + n, sizeof(line) - n, "%02X", r.data[i]);
+            buf.append(line, n);
+            buf += '\n';
+            continue;
+        }
+
+        std::string packet;
+        uint32_t original;
+        if (r.kind == TRACE_CAN) {
+            uint32_t can_id = htonl(r.id);      // SocketCAN 헤더의 ID는 네트워크 바이트 순서
+            packet.append((const char*)&can_id, 4);
+            packet += (char)r.length;
+            packet += (char)r.flags;
+            packet.append(2, '\0');
+            original = 8 + r.length;
+        }
+        else {
+            const uint8_t tag[] = { 0x00, 0x0C, 0x00, 0x04, 'd', 'o', 'i', 'p', 0, 0, 0, 0 }; // EXP_PDU_TAG_DISSECTOR_NAME
+            packet.append((const char*)tag, sizeof(tag));
+            original = sizeof(tag) + r.length;
+        }
+        packet.append((const char*)r.data, r.captured);
+
+        std::string body;
+        append_u32(body, r.kind == TRACE_CAN ? 0 : 1);
+        append_u32(body, ts >> 32);
+        append_u32(body, ts & 0xFFFFFFFF);
+        append_u32(body, packet.size());
+        append_u32(body, original);
+        append_padded(body, packet.data(), packet.size());
+        uint32_t epb_flags = r.direction == TRACE_RX ? 1 : 2; // inbound / outbound
+        append_option(body, 2, &epb_flags, 4);
+        if (r.kind == TRACE_DOIP) {
+            std::string comment = "session #" + std::to_string(r.id);
+            append_option(body, 1, comment.data(), comment.size());
+        }
+        append_u32(body, 0);
+        append_block(buf, 6, body);             // Enhanced Packet Block
+
+        if (buf.size() >= (1 << 20)) {
+            out.write(buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+    out.write(buf.data(), buf.size());
+    return out.good();
+}
+
+// --- 메트릭 엔드포인트 (Prometheus 텍스트 형식) ---
+// 127.0.0.1에서만 받습니다. 요청 하나에 응답 하나를 보내고 닫으며, 논블로킹 소켓으로 리액터에서 처리하므로
+// 스크레이프가 느려도 진단 경로를 막지 않습니다.
+struct MetricsClient {
+    std::string request;
+    std::string response;
+    size_t sent = 0;
+    Reactor::TimerId timer = 0;
+};
+std::unordered_map<int, MetricsClient> g_metrics_clients;
+
+int setup_metrics_socket() {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(g_config.metrics_port);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void on_metrics_accept(int server_sock) {
+    while (true) {
+        int fd = accept4(server_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        if ((int)g_metrics_clients.size() >= MAX_METRICS_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        MetricsClient& client = g_metrics_clients[fd];
+        client.timer = g_reactor.add_timer_ms(METRICS_CLIENT_TIMEOUT_MS, [fd]() {
+            g_metrics_clients[fd].timer = 0;
+            close_metrics_client(fd);
+        });
+        g_reactor.add(fd, EPOLLIN | EPOLLRDHUP, [fd](uint32_t events) { on_metrics_event(fd, events); });
+    }
+}
+
+void on_metrics_event(int fd, uint32_t events) {
+    auto it = g_metrics_clients.find(fd);
+    if (it == g_metrics_clients.end()) return;
+    MetricsClient& client = it->second;
+    if (events & EPOLLERR) {
+        close_metrics_client(fd);
+        return;
+    }
+
+    if (client.response.empty()) {
+        char buf[1024];
+        while (true) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n > 0) {
+                client.request.append(buf, n);
+                if (client.request.size() > METRICS_REQUEST_MAX) break;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            close_metrics_client(fd); // 요청을 다 보내기 전에 끊김
+            return;
+        }
+        if (client.request.size() > METRICS_REQUEST_MAX) {
+            close_metrics_client(fd);
+            return;
+        }
+        if (client.request.find("\r\n\r\n") == std::string::npos) return; // 헤더가 더 와야 함
+
+        std::string status = "200 OK";
+        std::string body;
+        if (client.request.compare(0, 13, "GET /metrics ") == 0 || client.request.compare(0, 6, "GET / ") == 0) {
+            body = render_metrics();
+        }
+        else {
+            status = "404 Not Found";
+            body = "GET /metrics\n";
+        }
+        client.response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    while (client.sent < client.response.size()) {
+        ssize_t n = send(fd, client.response.data() + client.sent, client.response.size() - client.sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            client.sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            g_reactor.modify(fd, EPOLLOUT | EPOLLRDHUP);
+            return;
+        }
+        break;
+    }
+    close_metrics_client(fd);
+}
+
+void close_metrics_client(int fd) {
+    auto it = g_metrics_clients.find(fd);
+    if (it == g_metrics_clients.end()) return;
+    g_reactor.cancel_timer(it->second.timer);
+    g_reactor.remove(fd);
+    close(fd);
+    g_metrics_clients.erase(it);
+}
+
+std::string render_metrics() {
+    std::ostringstream out;
+    auto header = [&out](const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+    auto histogram = [&out](const char* name, const std::string& labels, const Histogram& h) {
+        uint64_t cumulative = 0;
+        for (int i = 0; i < LATENCY_BUCKET_COUNT; ++i) {
+            cumulative += h.buckets[i];
+            out << name << "_bucket{" << labels << ",le=\"" << LATENCY_BUCKETS[i] << "\"} " << cumulative << "\n";
+        }
+        out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << h.count << "\n"
+            << name << "_sum{" << labels << "} " << h.sum << "\n"
+            << name << "_count{" << labels << "} " << h.count << "\n";
+    };
+    // ECU별 카운터 한 종류를 출력
+    auto per_link = [&out](const char* name, auto value) {
+        for (const auto& entry : g_links) {
+            out << name << "{ecu=\"" << entry.second.cfg.name << "\"} " << value(entry.second) << "\n";
+        }
+    };
+
+    header("uds_gateway_sessions_active", "gauge", "Connected DoIP testers");
+    out << "uds_gateway_sessions_active " << g_sessions.size() << "\n";
+    header("uds_gateway_sessions_total", "counter", "Accepted and rejected tester connections");
+    out << "uds_gateway_sessions_total{result=\"accepted\"} " << g_metrics.sessions_accepted << "\n"
+        << "uds_gateway_sessions_total{result=\"rejected\"} " << g_metrics.sessions_rejected << "\n";
+    header("uds_gateway_doip_bytes_total", "counter", "DoIP bytes exchanged with testers");
+    out << "uds_gateway_doip_bytes_total{direction=\"rx\"} " << g_metrics.doip_rx_bytes << "\n"
+        << "uds_gateway_doip_bytes_total{direction=\"tx\"} " << g_metrics.doip_tx_bytes << "\n";
+    header("uds_gateway_functional_requests_total", "counter", "Functionally addressed requests broadcast on CAN");
+    out << "uds_gateway_functional_requests_total " << g_metrics.functional_requests << "\n";
+    header("uds_gateway_functional_responses_total", "counter", "ECU responses collected for functionally addressed requests");
+    out << "uds_gateway_functional_responses_total " << g_metrics.functional_responses << "\n";
+    header("uds_gateway_can_rx_dropped_frames_total", "counter", "Frames dropped by the CAN socket receive queue");
+    out << "uds_gateway_can_rx_dropped_frames_total " << g_can_rx_drops << "\n";
+
+    header("uds_gateway_requests_total", "counter", "Diagnostic requests received from testers by ECU and SID");
+    for (const auto& entry : g_links) {
+        const LinkMetrics& m = entry.second.metrics;
+        for (int sid = 0; sid < 256; ++sid) {
+            if (m.requests_by_sid[sid] == 0) continue;
+            out << "uds_gateway_requests_total{ecu=\"" << entry.second.cfg.name << "\",sid=\"0x" << std::hex
+                << std::uppercase << (sid < 0x10 ? "0" : "") << sid << std::dec << std::nouppercase << "\"} "
+                << m.requests_by_sid[sid] << "\n";
+        }
+    }
+    header("uds_gateway_uds_bytes_total", "counter", "UDS bytes exchanged with ECUs");
+    for (const auto& entry : g_links) {
+        out << "uds_gateway_uds_bytes_total{ecu=\"" << entry.second.cfg.name << "\",direction=\"to_ecu\"} "
+            << entry.second.metrics.uds_tx_bytes << "\n"
+            << "uds_gateway_uds_bytes_total{ecu=\"" << entry.second.cfg.name << "\",direction=\"from_ecu\"} "
+            << entry.second.metrics.uds_rx_bytes << "\n";
+    }
+    header("uds_gateway_queued_requests", "gauge", "Requests waiting for the ECU channel");
+    per_link("uds_gateway_queued_requests", [](const IsoTpLink& l) { return queued_requests(l); });
+    header("uds_gateway_queue_rejects_total", "counter", "Requests refused with DoIP NACK 0x05 because the queue was full");
+    per_link("uds_gateway_queue_rejects_total", [](const IsoTpLink& l) { return l.queue_rejects; });
+    header("uds_gateway_fc_waits_total", "counter", "Times the gateway waited for a flow control frame");
+    per_link("uds_gateway_fc_waits_total", [](const IsoTpLink& l) { return l.metrics.fc_waits; });
+    header("uds_gateway_fc_timeouts_total", "counter", "Flow control timeouts (N_Bs)");
+    per_link("uds_gateway_fc_timeouts_total", [](const IsoTpLink& l) { return l.metrics.fc_timeouts; });
+    header("uds_gateway_cf_sequence_errors_total", "counter", "Consecutive frames received out of sequence");
+    per_link("uds_gateway_cf_sequence_errors_total", [](const IsoTpLink& l) { return l.metrics.cf_sequence_errors; });
+    header("uds_gateway_cf_timeouts_total", "counter", "Consecutive frame receive timeouts (N_Cr)");
+    per_link("uds_gateway_cf_timeouts_total", [](const IsoTpLink& l) { return l.metrics.cf_timeouts; });
+    header("uds_gateway_response_timeouts_total", "counter", "Requests the ECU did not answer within P2, or within P2* after 0x78");
+    for (const auto& entry : g_links) {
+        out << "uds_gateway_response_timeouts_total{ecu=\"" << entry.second.cfg.name << "\",timer=\"p2\"} "
+            << entry.second.metrics.p2_timeouts << "\n"
+            << "uds_gateway_response_timeouts_total{ecu=\"" << entry.second.cfg.name << "\",timer=\"p2_star\"} "
+            << entry.second.metrics.p2_star_timeouts << "\n";
+    }
+    header("uds_gateway_response_pending_total", "counter", "NRC 0x78 response pending messages received from ECUs");
+    per_link("uds_gateway_response_pending_total", [](const IsoTpLink& l) { return l.metrics.response_pending; });
+    header("uds_gateway_stale_responses_total", "counter", "ECU responses dropped because they did not match the request in flight");
+    per_link("uds_gateway_stale_responses_total", [](const IsoTpLink& l) { return l.metrics.stale_responses; });
+    header("uds_gateway_keepalives_sent_total", "counter", "TesterPresent frames sent by the gateway on behalf of testers");
+    per_link("uds_gateway_keepalives_sent_total", [](const IsoTpLink& l) { return l.metrics.keepalives_sent; });
+    header("uds_gateway_keepalives_absorbed_total", "counter", "Tester TesterPresent requests handled without reaching the ECU");
+    per_link("uds_gateway_keepalives_absorbed_total", [](const IsoTpLink& l) { return l.metrics.keepalives_absorbed; });
+    header("uds_gateway_stmin_wait_seconds_total", "counter", "Time spent between consecutive frames to honour STmin");
+    per_link("uds_gateway_stmin_wait_seconds_total", [](const IsoTpLink& l) { return l.metrics.stmin_wait_seconds; });
+    header("uds_gateway_stmin_spin_seconds_total", "counter", "Part of the STmin wait spent busy-waiting");
+    per_link("uds_gateway_stmin_spin_seconds_total", [](const IsoTpLink& l) { return l.metrics.stmin_spin_seconds; });
+    header("uds_gateway_did_cache_total", "counter", "ReadDataByIdentifier cache lookups");
+    for (const auto& entry : g_links) {
+        out << "uds_gateway_did_cache_total{ecu=\"" << entry.second.cfg.name << "\",result=\"hit\"} " << entry.second.did_cache_hits << "\n"
+            << "uds_gateway_did_cache_total{ecu=\"" << entry.second.cfg.name << "\",result=\"miss\"} " << entry.second.did_cache_misses << "\n";
+    }
+    header("uds_gateway_periodic_records_total", "counter", "Periodic DID records forwarded to testers");
+    per_link("uds_gateway_periodic_records_total", [](const IsoTpLink& l) { return l.periodic_records; });
+
+    header("uds_gateway_fc_wait_seconds", "histogram", "Time from first frame or block end to flow control");
+    for (const auto& entry : g_links) {
+        histogram("uds_gateway_fc_wait_seconds", "ecu=\"" + entry.second.cfg.name + "\"", entry.second.metrics.fc_wait);
+    }
+    header("uds_gateway_ecu_response_seconds", "histogram", "Time from request sent to final ECU response, including 0x78 extensions");
+    for (const auto& entry : g_links) {
+        for (const auto& sid : entry.second.metrics.response_by_sid) {
+            char labels[96];
+            snprintf(labels, sizeof(labels), "ecu=\"%s\",sid=\"0x%02X\"", entry.second.cfg.name.c_str(), sid.first);
+            histogram("uds_gateway_ecu_response_seconds", labels, sid.second);
+        }
+    }
+    return out.str();
+}
+
+// --- CAN 소켓 설정 함수 ---
+bool resolve_can_ifindex(int sock, int& ifindex) {
+    ifreq ifr;
+    strncpy(ifr.ifr_name, g_config.can_interface.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) return false;
+    ifindex = ifr.ifr_ifindex;
+    return true;
+}
+
+int setup_can_socket() {
+    int sock = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (sock < 0) return -1;
+    sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    if (!resolve_can_ifindex(sock, addr.can_ifindex)) { close(sock); return -1; }
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(sock); return -1; }
+    // 수신 큐 유실 수를 매 프레임 보조 데이터로 받아 적응형 FC의 백오프 근거로 씁니다.
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+    // 유저스페이스 ISO-TP로 처리하는 ECU의 응답 ID만 커널에서 통과시킵니다.
+    // (커널 ISO-TP ECU의 프레임은 해당 CAN_ISOTP 소켓이 받으므로 여기선 제외)
+    // 주기 DID 전용 ID는 ISO-TP가 아니므로 백엔드와 상관없이 이 소켓에서 받습니다.
+    std::vector<can_filter> rfilter;
+    for (const auto& entry : g_links) {
+        for (uint32_t rx_id : { entry.second.cfg.rx_id, entry.second.cfg.periodic_rx_id }) {
+            if (rx_id == 0 || (rx_id == entry.second.cfg.rx_id && entry.second.cfg.backend != IsoTpBackend::USER)) continue;
+            can_filter f;
+            f.can_id = rx_id;
+            f.can_mask = CAN_EFF_FLAG | ((rx_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+            rfilter.push_back(f);
+        }
+    }
+    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, rfilter.data(), rfilter.size() * sizeof(can_filter));
+
+    // CAN FD ECU가 있으면 인터페이스 MTU(72)를 확인하고 FD 프레임 송수신을 켭니다.
+    // (vcan 테스트: ip link set vcan0 mtu 72)
+    bool want_fd = false;
+    for (const auto& entry : g_links) {
+        if (entry.second.cfg.backend == IsoTpBackend::USER && entry.second.cfg.can_fd) want_fd = true;
+    }
+    if (want_fd) {
+        ifreq ifr;
+        strncpy(ifr.ifr_name, g_config.can_interface.c_str(), IFNAMSIZ - 1);
+        ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+        int enable_fd = 1;
+        if (ioctl(sock, SIOCGIFMTU, &ifr) < 0 || ifr.ifr_mtu != CANFD_MTU ||
+            setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable_fd, sizeof(enable_fd)) < 0) {
+            std::cerr << g_config.can_interface << ": CAN FD를 지원하지 않습니다 (MTU 72 필요). FD ECU를 Classic CAN으로 대체합니다." << std::endl;
+            for (auto& entry : g_links) {
+                if (entry.second.cfg.backend == IsoTpBackend::USER) entry.second.cfg.can_fd = false;
+            }
+        }
+    }
+    return sock;
+}
+
+// --- 커널 ISO-TP 소켓 설정 함수 ---
+// 분할/조립, FC 응답, STmin 대기를 커널이 처리하고 소켓에는 UDS 메시지 단위로만 오갑니다.
+// 커널은 bind 이후 옵션 변경을 허용하지 않으므로 FC 값이 바뀌면 소켓을 새로 만듭니다.
+int setup_isotp_socket(const IsoTpLink& link) {
+    const EcuConfig& ecu = link.cfg;
+    int sock = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_ISOTP);
+    if (sock < 0) return -1;
+
+    // 수신 시 ECU에 보낼 FC 파라미터
+    can_isotp_fc_options fc_opts;
+    memset(&fc_opts, 0, sizeof(fc_opts));
+    fc_opts.bs = link.rx_fc_bs;
+    fc_opts.stmin = link.rx_fc_stmin;
+    fc_opts.wftmax = 0;
+    setsockopt(sock, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc_opts, sizeof(fc_opts));
+
+    // CAN FD: 링크 계층을 FD MTU와 64바이트 TX_DL로 설정 (인터페이스 MTU가 72가 아니면 bind가 실패)
+    if (ecu.can_fd) {
+        can_isotp_ll_options ll_opts;
+        memset(&ll_opts, 0, sizeof(ll_opts));
+        ll_opts.mtu = CANFD_MTU;
+        ll_opts.tx_dl = CANFD_MAX_DLEN;
+        ll_opts.tx_flags = CANFD_BRS;
+        setsockopt(sock, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &ll_opts, sizeof(ll_opts));
+    }
+
+    sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_addr.tp.tx_id = ecu.tx_id;
+    addr.can_addr.tp.rx_id = ecu.rx_id;
+    if (!resolve_can_ifindex(sock, addr.can_ifindex) ||
+        bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        close(sock);
+        errno = saved;
+        return -1;
+    }
+    return sock;
+}
+
+// --- 요청 중재 ---
+void enqueue_request(IsoTpLink& link, uint64_t session_id, std::vector<uint8_t> uds_request) {
+    queue_request(link, PendingRequest{ session_id, std::move(uds_request) });
+    dispatch_next_request(link);
+}
+
+// 요청 버퍼는 ECU마다 몇 개를 돌려 써서 메시지마다 힙 할당을 하지 않습니다 (플래시 블록도 같은 크기로 반복).
+std::vector<uint8_t> request_buffer_acquire(IsoTpLink& link) {
+    if (link.request_pool.empty()) return {};
+    std::vector<uint8_t> buffer = std::move(link.request_pool.back());
+    link.request_pool.pop_back();
+    return buffer;
+}
+
+void request_buffer_release(IsoTpLink& link, std::vector<uint8_t>& buffer) {
+    buffer.clear();
+    if (buffer.capacity() > 0 && link.request_pool.size() < REQUEST_BUFFER_POOL) link.request_pool.push_back(std::move(buffer));
+    buffer = {};
+}
+
+void queue_request(IsoTpLink& link, PendingRequest req) {
+    req.priority = request_priority(req.uds.data(), req.uds.size());
+    link.pending[req.session_id].push_back(std::move(req));
+}
+
+RequestPriority request_priority(const uint8_t* uds_request, size_t len) {
+    if (len > BULK_REQUEST_BYTES) return PRIORITY_BULK;
+    switch (uds_request[0]) {
+    case 0x3E: // TesterPresent
+    case 0x10: // DiagnosticSessionControl
+    case 0x11: // ECUReset
+    case 0x14: // ClearDiagnosticInformation
+    case 0x28: // CommunicationControl
+    case 0x85: // ControlDTCSetting
+        return PRIORITY_CONTROL;
+    case 0x22: // ReadDataByIdentifier: DID 여러 개면 대용량
+        return len > 3 ? PRIORITY_BULK : PRIORITY_NORMAL;
+    case 0x23: case 0x3D: // Read/WriteMemoryByAddress
+    case 0x34: case 0x35: case 0x36: case 0x37: case 0x38: // 다운로드/업로드
+        return PRIORITY_BULK;
+    default:
+        return PRIORITY_NORMAL;
+    }
+}
+
+size_t queued_requests(const IsoTpLink& link) {
+    size_t count = 0;
+    for (const auto& entry : link.pending) count += entry.second.size();
+    return count;
+}
+
+bool has_pending_request(const IsoTpLink& link, uint64_t session_id) {
+    return link.pending.count(session_id) > 0;
+}
+
+void erase_pending_requests(IsoTpLink& link, uint64_t session_id, bool flash_only) {
+    auto it = link.pending.find(session_id);
+    if (it == link.pending.end()) return;
+    if (flash_only) {
+        it->second.erase(std::remove_if(it->second.begin(), it->second.end(),
+                                        [](const PendingRequest& r) { return r.flash; }),
+                         it->second.end());
+    }
+    if (!flash_only || it->second.empty()) link.pending.erase(it);
+}
+
+// 진행 중인 요청까지 세어 한도를 넘으면 거절합니다. 제어 요청에는 여유 자리를 더 줘
+// 대용량 요청이 대기열을 채워도 TesterPresent/리셋은 들어갈 수 있게 합니다.
+bool request_queue_full(const IsoTpLink& link, const uint8_t* uds_request, size_t len) {
+    size_t in_use = queued_requests(link) + ((link.tx_state != IsoTpTxState::IDLE || link.awaiting_response) ? 1 : 0);
+    size_t limit = link.cfg.queue_limit;
+    if (request_priority(uds_request, len) == PRIORITY_CONTROL) limit += CONTROL_QUEUE_RESERVE;
+    return in_use >= limit;
+}
+
+// 각 세션의 맨 앞 요청만 후보로 보고, 우선순위가 가장 높은 후보들 사이에서는 마지막으로 처리한 세션
+// 다음 세션부터 돌아가며 꺼냅니다 (라운드 로빈). 세션 안의 순서는 바꾸지 않습니다.
+bool pop_next_request(IsoTpLink& link, PendingRequest& out) {
+    auto& queues = link.pending;
+    if (queues.empty()) return false;
+
+    int best = PRIORITY_COUNT;
+    for (const auto& entry : queues) best = std::min<int>(best, entry.second.front().priority);
+
+    auto first_from = [&](std::map<uint64_t, std::deque<PendingRequest>>::iterator it) {
+        while (it != queues.end() && it->second.front().priority != best) ++it;
+        return it;
+    };
+    auto it = first_from(queues.upper_bound(link.last_served_session[best]));
+    if (it == queues.end()) it = first_from(queues.begin());
+
+    out = std::move(it->second.front());
+    it->second.pop_front();
+    link.last_served_session[best] = it->first;
+    if (it->second.empty()) queues.erase(it);
+    return true;
+}
+
+// 채널이 비어 있으면 대기 중인 다음 요청을 CAN으로 내보냅니다.
+void dispatch_next_request(IsoTpLink& link) {
+    // 기능 요청이 기다리는 동안에는 채널을 비워 두고, 응답 창이 닫힐 때 다시 불립니다.
+    if (g_functional.active) return;
+    if (!g_functional.pending.empty()) {
+        functional_dispatch();
+        return;
+    }
+    PendingRequest req;
+    while (link.tx_state == IsoTpTxState::IDLE && !link.awaiting_response && pop_next_request(link, req)) {
+        if (g_sessions.find(req.session_id) == g_sessions.end()) continue; // 그 사이 끊긴 세션
+
+        link.owner_session = req.session_id;
+        link.owner_flash = req.flash;
+        did_cache_on_request(link, req.uds);
+        link.inflight_did = did_cache_ttl(link, req.uds) > 0 ? ((req.uds[1] << 8) | req.uds[2]) : -1;
+        link.inflight_did_generation = link.did_cache_generation;
+        link.inflight_sid = req.uds[0];
+        link.inflight_expired = false;
+        if (req.uds[0] == 0x2A) link.inflight_periodic = req.uds;
+        else link.inflight_periodic.clear();
+        if (!isotp_send(link, std::move(req.uds))) {
+            std::cerr << "세션 #" << req.session_id << " 요청 CAN 전송 실패." << std::endl;
+        }
+    }
+    isotp_fc_try_reopen(link); // 보낼 요청이 없어 채널이 비었으면 미뤄 둔 FC 변경 반영
+}
+
+// suppressPosRspMsgIndicationBit가 켜진 요청은 응답을 기다리지 않습니다.
+bool expects_response(const std::vector<uint8_t>& uds_request) {
+    if (uds_request.size() < 2) return true;
+    switch (uds_request[0]) {
+    case 0x10: case 0x11: case 0x27: case 0x28: case 0x31:
+    case 0x3E: case 0x85: case 0x86: case 0x87:
+        return (uds_request[1] & 0x80) == 0;
+    default:
+        return true;
+    }
+}
+
+// --- TesterPresent 대행 ---
+// 0x10 긍정 응답으로 기본 세션(0x01)이 아닌 세션에 들어가면, 마지막 요청 후 tester_present_ms가 지날 때마다
+// 게이트웨이가 직접 0x3E 0x80 SF를 보냅니다. 진단기의 0x3E는 ECU로 보내지 않고 게이트웨이가 처리합니다.
+// 리액터 타이머로 보내고 채널이 바쁘면 건너뛰므로 진행 중인 ISO-TP 전송 사이에 끼어들지 않습니다.
+// (진행 중인 요청이 이미 S3를 다시 시작시키므로 건너뛰어도 세션은 유지됩니다.)
+void keepalive_on_response(IsoTpLink& link, const UdsMessage& uds_response) {
+    if (g_config.tester_present_ms <= 0 || uds_response.size() < 2) return;
+    if (uds_response[0] == 0x50 && uds_response[1] != 0x01) {
+        if (link.keepalive_session == 0) {
+            std::cout << "[Keepalive] " << link.cfg.name << " 비기본 세션 진입. TesterPresent를 게이트웨이가 대신 보냅니다." << std::endl;
+        }
+        link.keepalive_session = link.owner_session;
+        if (link.keepalive_timer == 0) keepalive_tick(link);
+    }
+    else if (uds_response[0] == 0x50 || uds_response[0] == 0x51) { // 기본 세션 복귀 또는 ECU 리셋
+        keepalive_stop(link);
+    }
+}
+
+// 대행 중이면 진단기의 TesterPresent를 ECU로 보내지 않습니다. 응답을 원하는 0x3E 0x00에는 게이트웨이가 0x7E로
+// 답하되, 같은 세션의 앞선 요청이 남아 있으면 응답 순서가 바뀌지 않도록 ECU로 보냅니다.
+bool keepalive_absorb(IsoTpLink& link, DoipSession& session, const std::vector<uint8_t>& uds_request) {
+    if (link.keepalive_session == 0 || uds_request.size() != 2 || uds_request[0] != 0x3E || (uds_request[1] & 0x7F) != 0) {
+        return false;
+    }
+    if (uds_request[1] == 0x00) {
+        if (has_pending_request(link, session.id) || (link.owner_session == session.id &&
+            (link.tx_state != IsoTpTxState::IDLE || link.awaiting_response))) {
+            return false;
+        }
+        send_diagnostic_message(session, link.cfg.logical_address, { 0x7E, 0x00 });
+    }
+    link.metrics.keepalives_absorbed++;
+    return true;
+}
+
+void keepalive_tick(IsoTpLink& link) {
+    link.keepalive_timer = 0;
+    Clock::time_point now = Clock::now();
+    auto period = std::chrono::milliseconds(g_config.tester_present_ms);
+    bool busy = link.tx_state != IsoTpTxState::IDLE || link.awaiting_response || link.rx_active || g_functional.active;
+
+    if (!busy && now - link.last_request_at >= period) {
+        if (keepalive_send(link)) {
+            link.last_request_at = now;
+            link.metrics.keepalives_sent++;
+        }
+        else {
+            std::cerr << "[Keepalive] " << link.cfg.name << " TesterPresent 전송 실패 (" << strerror(errno) << ")" << std::endl;
+        }
+    }
+    Clock::time_point next = std::max(link.last_request_at + period, now + std::chrono::milliseconds(KEEPALIVE_RETRY_MS));
+    link.keepalive_timer = g_reactor.add_timer(next, [&link]() { keepalive_tick(link); });
+}
+
+// 0x3E 0x80 SF 하나. 커널 백엔드 ECU는 원시 소켓이 아니라 그 ECU의 CAN_ISOTP 소켓으로 보내
+// (FD 링크 설정과 패딩을 커널이 맞추므로) 원시 소켓의 FD 지원 여부와 상관없이 나갑니다.
+bool keepalive_send(IsoTpLink& link) {
+    static const uint8_t tester_present[] = { 0x3E, 0x80 }; // suppressPosRspMsgIndicationBit
+    if (link.isotp_sock >= 0) {
+        return write(link.isotp_sock, tester_present, sizeof(tester_present)) == (ssize_t)sizeof(tester_present);
     }
+    canfd_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = link.cfg.tx_id;
+    frame.len = 1 + sizeof(tester_present);
+    frame.data[0] = sizeof(tester_present);
+    memcpy(&frame.data[1], tester_present, sizeof(tester_present));
+    return can_write_frame(link, frame);
+}
 
-    std::cout << "DoIP 게이트웨이 시작. 포트 " << DOIP_PORT << "에서 연결 대기 중..." << std::endl;
+void keepalive_stop(IsoTpLink& link) {
+    if (link.keepalive_session == 0) return;
+    std::cout << "[Keepalive] " << link.cfg.name << " TesterPresent 대행 종료." << std::endl;
+    g_reactor.cancel_timer(link.keepalive_timer);
+    link.keepalive_session = 0;
+}
 
-    while (true) {
-        int client_sock = accept(server_sock, nullptr, nullptr);
-        if (client_sock < 0) {
-            std::cerr << "클라이언트 연결 수락 실패." << std::endl;
-            continue;
-        }
+// --- 기능 주소 요청 ---
+// 진단기가 기능 주소(functional_address)로 보낸 요청을 functional_tx ID의 SF로 한 번만 내보내고,
+// functional_window_ms 동안 각 ECU 채널에서 (동시에) 재조립된 응답을 그 ECU 주소의 DoIP 메시지로 하나씩 돌려줍니다.
+void functional_enqueue(DoipSession& session, std::vector<uint8_t> uds_request) {
+    g_functional.pending.push_back(PendingRequest{ session.id, std::move(uds_request) });
+    functional_dispatch();
+}
 
-        std::cout << "\n진단기 클라이언트 연결됨. 세션 시작." << std::endl;
-        handle_doip_session(client_sock); // 연결된 클라이언트 처리
-        close(client_sock);
-        std::cout << "클라이언트 세션 종료." << std::endl;
+bool functional_channels_idle() {
+    for (const auto& entry : g_links) {
+        const IsoTpLink& link = entry.second;
+        if (link.tx_state != IsoTpTxState::IDLE || link.awaiting_response || link.rx_active) return false;
     }
-
-    close(server_sock);
-    return 0;
+    return true;
 }
 
-// --- CAN -> DoIP 데이터 전송 전담 스레드 함수 ---
-void can_to_doip_forwarder(int can_sock, int client_sock, std::atomic<bool>& session_active) {
-    std::cout << "[CAN->DoIP Thread] 수신 대기 시작." << std::endl;
-    while (session_active) {
-        can_frame rx_frame;
-        int bytes_read = read(can_sock, &rx_frame, sizeof(can_frame));
-
-        if (bytes_read <= 0) {
-            if (!session_active) break;
-            continue; // 타임아웃은 정상, 계속 시도
+void functional_dispatch() {
+    while (!g_functional.active && g_functional.retry_timer == 0 && !g_functional.pending.empty() && functional_channels_idle()) {
+        PendingRequest req = std::move(g_functional.pending.front());
+        g_functional.pending.pop_front();
+        auto session_it = g_sessions.find(req.session_id);
+        if (session_it == g_sessions.end()) continue; // 그 사이 끊긴 세션
+
+        // 기능 주소 요청은 모든 ECU가 받아야 하므로 항상 Classic CAN SF로 보냅니다.
+        canfd_frame frame;
+        memset(&frame, 0, sizeof(frame));
+        frame.can_id = g_config.functional_tx_id;
+        frame.len = req.uds.size() + 1;
+        frame.data[0] = req.uds.size();
+        memcpy(&frame.data[1], req.uds.data(), req.uds.size());
+        if (!can_write_frame(false, frame)) {
+            if (errno == ENOBUFS || errno == EAGAIN) {
+                // 컨트롤러 송신 큐가 가득 참: 같은 요청을 잠시 후 다시 보냄
+                g_functional.pending.push_front(std::move(req));
+                g_functional.retry_timer = g_reactor.add_timer_ms(CAN_TX_RETRY_MS, []() {
+                    g_functional.retry_timer = 0;
+                    functional_dispatch();
+                    if (g_functional.active) return;
+                    for (auto& entry : g_links) dispatch_next_request(entry.second);
+                });
+                return;
+            }
+            std::cerr << "기능 주소 요청 CAN 전송 실패 (" << strerror(errno) << ")" << std::endl;
+            send_diagnostic_message(*session_it->second, g_config.functional_address, { 0x7F, req.uds[0], NRC_CAN_TX_FAILED });
+            continue;
+        }
+        g_metrics.functional_requests++;
+        if (g_config.log_messages) {
+            std::cout << "  -> CAN: 기능 주소 Single Frame 전송 (0x" << std::hex << (g_config.functional_tx_id & CAN_EFF_MASK)
+                      << std::dec << ")" << std::endl;
         }
 
-        // --- FC 프레임 처리 로직 ---
-        // 프레임 타입이 3(FC)이면 무조건 큐에 넣습니다.
-        uint8_t pci_type = (rx_frame.data[0] & 0xF0) >> 4;
-
-        if (pci_type == 3) { // Flow Control 프레임인 경우
-            std::lock_guard<std::mutex> lock(fc_queue_mutex);
-            fc_frame_queue.push(std::vector<uint8_t>(rx_frame.data, rx_frame.data + rx_frame.can_dlc));
-            fc_queue_cv.notify_one(); // 기다리는 메인 스레드를 깨움
-            continue; // 이 프레임은 처리했으므로 루프 계속
+        // 모든 채널의 응답을 이 세션으로 돌리고, 캐시/주기 DID 상태는 물리 요청처럼 갱신합니다.
+        for (auto& entry : g_links) {
+            IsoTpLink& link = entry.second;
+            link.owner_session = req.session_id;
+            link.owner_flash = false;
+            link.inflight_did = -1;
+            link.inflight_sid = req.uds[0];
+            link.inflight_expired = false;
+            link.inflight_periodic.clear();
+            link.last_request_at = Clock::now();
+            did_cache_on_request(link, req.uds);
         }
+        if (!expects_response(req.uds)) continue;
 
-        // 여기서부터는 기존의 isotp_receive 로직을 직접 처리
-        std::vector<uint8_t> uds_response;
+        g_functional.active = true;
+        g_functional.session_id = req.session_id;
+        g_functional.responses = 0;
+        g_functional.window_timer = g_reactor.add_timer_ms(g_config.functional_window_ms, functional_close_window);
+    }
+}
 
-        switch (pci_type) {
-        case 0: // Single Frame
-            uds_response = isotp_handle_single_frame(rx_frame);
-            break;
-        case 1: // First Frame
-            uds_response = isotp_handle_multi_frame(can_sock, rx_frame);
-            break;
-        default:
-            std::cerr << "잘못된 시작 프레임 수신 (Type: " << (int)pci_type << ")" << std::endl;
-            continue; // 루프 계속
-        }
+// 0x78(응답 지연)을 보낸 ECU가 있으면 최종 응답을 받을 수 있도록 창을 늘립니다.
+void functional_on_response(const UdsMessage& uds_response) {
+    if (uds_response.size() >= 3 && uds_response[0] == 0x7F && uds_response[2] == 0x78) {
+        g_reactor.cancel_timer(g_functional.window_timer);
+        g_functional.window_timer = g_reactor.add_timer_ms(FUNCTIONAL_PENDING_MS, functional_close_window);
+        return;
+    }
+    g_functional.responses++;
+    g_metrics.functional_responses++;
+}
 
-        if (!session_active) break;
-        if (uds_response.empty()) {
-            continue;
+void functional_close_window() {
+    g_functional.window_timer = 0;
+    // 아직 재조립 중인 응답이 있으면 끝날 때까지 (CF 타임아웃이 한도) 창을 늘립니다.
+    for (const auto& entry : g_links) {
+        if (entry.second.rx_active) {
+            g_functional.window_timer = g_reactor.add_timer_ms(g_config.functional_window_ms, functional_close_window);
+            return;
         }
+    }
+    g_functional.active = false;
+    std::cout << "[CAN -> DoIP] 기능 주소 요청 응답 창 종료 (세션 #" << g_functional.session_id << ", ECU 응답 "
+              << g_functional.responses << "개)" << std::endl;
 
-        std::cout << "[CAN -> DoIP] CAN으로부터 UDS 데이터 수신 (" << uds_response.size() << " 바이트)" << std::endl;
+    functional_dispatch();
+    if (g_functional.active) return;
+    for (auto& entry : g_links) dispatch_next_request(entry.second);
+}
 
-        std::vector<uint8_t> final_uds_payload;
+// --- RDBI 응답 캐시 ---
+// 설정에서 TTL을 준 DID의 단일 DID 0x22 요청은 유효한 긍정 응답이 있으면 ECU까지 가지 않고 바로 응답합니다.
+// 0x2E(같은 DID)는 해당 항목을, 0x10/0x11(세션 변경/리셋)은 그 ECU의 모든 항목을 무효화합니다.
+// 무효화는 요청이 대기열에 들어갈 때가 아니라 ECU로 보낼 때와 긍정 응답(0x6E/0x50/0x51)을 받을 때 합니다.
+// 세대 번호를 매번 올려, 그 전에 보낸 0x22의 응답은 캐시에 넣지 않습니다.
+int did_cache_ttl(const IsoTpLink& link, const std::vector<uint8_t>& uds_request) {
+    if (uds_request.size() != 3 || uds_request[0] != 0x22) return 0;
+    auto it = link.cfg.did_cache_ttl_ms.find((uds_request[1] << 8) | uds_request[2]);
+    return it == link.cfg.did_cache_ttl_ms.end() ? 0 : it->second;
+}
 
-        uint8_t first_byte = uds_response[0];
+bool did_cache_serve(IsoTpLink& link, DoipSession& session, const std::vector<uint8_t>& uds_request) {
+    if (did_cache_ttl(link, uds_request) <= 0) return false;
+    // 같은 세션의 앞선 요청이 아직 남아 있으면 응답 순서가 뒤바뀌지 않도록 ECU로 보냄
+    if (has_pending_request(link, session.id) || (link.owner_session == session.id &&
+        (link.tx_state != IsoTpTxState::IDLE || link.awaiting_response))) {
+        return false;
+    }
 
-        // UDS 표준 응답 SID는 긍정 응답(0x40~0x7E)과 부정 응답(0x7F)을 포함합니다.
-        // 첫 바이트가 이 범위에 속하면, 이미 유효한 UDS 응답이므로 변환하지 않습니다.
-        if (first_byte >= 0x40 && first_byte <= 0x7F) {
-            // 원본 UDS 응답을 그대로 사용
-            final_uds_payload = uds_response;
-        }
-        else {
-            // 표준 응답 SID가 아닌 경우 (예: DID로 시작하는 주기적 데이터)
-            // 진단 라이브러리가 인식할 수 있도록 0x62(RDBI 긍정 응답)를 붙여줍니다.
-            std::cout << "[Gateway] 비표준 응답을 정식 UDS 응답(0x62)으로 변환합니다." << std::endl;
-            final_uds_payload.resize(1 + uds_response.size());
-            final_uds_payload[0] = 0x62; // ReadDataByIdentifier Positive Response
-            memcpy(final_uds_payload.data() + 1, uds_response.data(), uds_response.size());
-        }
-
-        size_t doip_payload_size = 4 + final_uds_payload.size();
-        std::vector<uint8_t> resp_msg(sizeof(DoIPHeader) + doip_payload_size);
-        DoIPHeader* resp_header = (DoIPHeader*)resp_msg.data();
-        resp_header->version = 2; resp_header->inverse_version = ~2;
-        resp_header->payload_type = htons(0x8001);
-        resp_header->payload_length = htonl(doip_payload_size);
-        uint16_t* sa = (uint16_t*)(resp_msg.data() + sizeof(DoIPHeader));
-        uint16_t* ta = (uint16_t*)(resp_msg.data() + sizeof(DoIPHeader) + 2);
-        *sa = htons(SERVER_LOGICAL_ADDRESS);
-        *ta = htons(CLIENT_LOGICAL_ADDRESS);
-        memcpy(resp_msg.data() + sizeof(DoIPHeader) + 4, final_uds_payload.data(), final_uds_payload.size());
-
-        {
-            std::lock_guard<std::mutex> lock(client_socket_mutex);
-            if (write(client_sock, resp_msg.data(), resp_msg.size()) <= 0) {
-                std::cerr << "[CAN->DoIP Thread] 클라이언트 소켓 쓰기 실패. 스레드 종료." << std::endl;
-                session_active = false;
-            }
-        }
+    uint16_t did = (uds_request[1] << 8) | uds_request[2];
+    auto it = link.did_cache.find(did);
+    if (it == link.did_cache.end() || Clock::now() >= it->second.expires) {
+        link.did_cache_misses++;
+        return false;
     }
-    std::cout << "[CAN->DoIP Thread] 스레드 종료." << std::endl;
+    link.did_cache_hits++;
+    if (g_config.log_messages) std::cout << "[Cache] " << link.cfg.name << " DID 0x" << std::hex << did << std::dec << " 캐시 응답" << std::endl;
+    send_diagnostic_message(session, link.cfg.logical_address, it->second.response);
+    return true;
 }
 
-// --- 메인 세션 처리 함수 (DoIP -> CAN 전송만 담당) ---
-void handle_doip_session(int client_sock) {
-    int can_sock = setup_can_socket();
-    if (can_sock < 0) {
-        std::cerr << "CAN 소켓 설정 실패." << std::endl;
+void did_cache_invalidate(IsoTpLink& link, const uint8_t* uds, size_t len) {
+    switch (uds[0]) {
+    case 0x2E: case 0x6E: // WriteDataByIdentifier (요청/긍정 응답 모두 [SID][DID])
+        if (len >= 3) link.did_cache.erase((uds[1] << 8) | uds[2]);
+        break;
+    case 0x10: case 0x50: // DiagnosticSessionControl
+    case 0x11: case 0x51: // ECUReset
+        link.did_cache.clear();
+        break;
+    default:
         return;
     }
-    std::cout << "CAN 소켓이 성공적으로 설정되었습니다." << std::endl;
-
-    std::atomic<bool> session_active(true);
+    link.did_cache_generation++;
+}
 
-    // CAN -> DoIP 수신 전용 스레드 시작
-    std::thread can_reader(can_to_doip_forwarder, can_sock, client_sock, std::ref(session_active));
+void did_cache_on_request(IsoTpLink& link, const std::vector<uint8_t>& uds_request) {
+    did_cache_invalidate(link, uds_request.data(), uds_request.size());
+}
 
-    while (session_active) {
-        // 1. DoIP 헤더(고정 8바이트) 먼저 읽기
-        DoIPHeader header;
-        int bytes_read = read(client_sock, &header, sizeof(DoIPHeader));
-        if (bytes_read <= 0) {
-            session_active = false; // 클라이언트 연결 끊김
-            break;
-        }
+void did_cache_on_response(IsoTpLink& link, const UdsMessage& uds_response) {
+    did_cache_invalidate(link, uds_response.data(), uds_response.size());
+    if (link.inflight_did < 0 || link.inflight_did_generation != link.did_cache_generation) return;
+    if (uds_response.size() < 3 || uds_response[0] != 0x62 ||
+        ((uds_response[1] << 8) | uds_response[2]) != link.inflight_did) {
+        return;
+    }
+    int ttl_ms = link.cfg.did_cache_ttl_ms[link.inflight_did];
+    DidCacheEntry& entry = link.did_cache[link.inflight_did];
+    entry.response.assign(uds_response.data(), uds_response.data() + uds_response.size());
+    entry.expires = Clock::now() + std::chrono::milliseconds(ttl_ms);
+    link.inflight_did = -1;
+}
 
-        if (bytes_read != sizeof(DoIPHeader)) {
-            std::cerr << "DoIP 헤더를 완전히 수신하지 못했습니다." << std::endl;
-            continue;
-        }
+// --- 주기 DID (ReadDataByPeriodicIdentifier, 0x2A) ---
+// 0x2A 요청 [0x2A][전송 모드 1~3 시작 / 4 중지][pDID...]가 긍정 응답을 받으면 pDID별로 요청 세션을 기록하고,
+// 이후 ECU가 보내는 [pDID][데이터] 메시지를 그 세션에 DID 0xF2xx의 RDBI 응답(0x62 F2 pDID 데이터)으로 전달합니다.
+// 높은 전송률에서 레코드마다 TCP 쓰기가 일어나지 않도록 periodic_flush_ms 동안 모아 한 번에 보냅니다.
+void periodic_on_response(IsoTpLink& link, const UdsMessage& uds_response) {
+    uint8_t sid = uds_response[0];
+    if (sid == 0x50 || sid == 0x51) { // 세션 변경/리셋이 되면 ECU가 주기 전송을 멈춤
+        link.periodic_owner.clear();
+        return;
+    }
+    if (sid != 0x6A || link.inflight_periodic.size() < 2) return;
 
-        // 2. 페이로드 길이 파싱 (Network to Host byte order)
-        uint32_t payload_length = ntohl(header.payload_length);
-        uint16_t payload_type = ntohs(header.payload_type);
+    const std::vector<uint8_t>& req = link.inflight_periodic;
+    if (req[1] == 0x04) { // stopSending (pDID가 없으면 전부 중지)
+        if (req.size() == 2) link.periodic_owner.clear();
+        for (size_t i = 2; i < req.size(); ++i) link.periodic_owner.erase(req[i]);
+    }
+    else {
+        for (size_t i = 2; i < req.size(); ++i) link.periodic_owner[req[i]] = link.owner_session;
+    }
+    std::cout << "[Periodic] " << link.cfg.name << " 주기 DID " << link.periodic_owner.size() << "개 예약됨" << std::endl;
+    link.inflight_periodic.clear();
+}
 
-        // 3. 페이로드 길이만큼 정확히 데이터 수신
-        std::vector<uint8_t> payload_buffer(payload_length);
-        size_t total_received = 0;
-        while (total_received < payload_length) {
-            bytes_read = read(client_sock, payload_buffer.data() + total_received, payload_length - total_received);
-            if (bytes_read <= 0) {
-                session_active = false;
-                break; // 수신 중 오류 또는 연결 끊김
-            }
-            total_received += bytes_read;
-        }
+// 예약된 pDID로 시작하는 메시지면 해당 세션의 묶음에 넣고 true를 돌려줍니다.
+bool periodic_on_message(IsoTpLink& link, const uint8_t* data, size_t len) {
+    if (len == 0 || link.periodic_owner.empty()) return false;
+    uint8_t pdid = data[0];
+    // 기다리는 요청의 응답 SID와 겹치면 응답으로 취급
+    if (link.awaiting_response && (pdid == (uint8_t)(link.inflight_sid + 0x40) || pdid == 0x7F)) return false;
+    auto owner = link.periodic_owner.find(pdid);
+    if (owner == link.periodic_owner.end()) return false;
+    auto it = g_sessions.find(owner->second);
+    if (it == g_sessions.end()) return true;
+    DoipSession& session = *it->second;
+
+    // [DoIP 헤더][SA][TA][0x62][0xF2][pDID][데이터]
+    size_t uds_size = 2 + len;
+    size_t at = session.periodic_batch.size();
+    session.periodic_batch.resize(at + sizeof(DoIPHeader) + 4 + uds_size);
+    uint8_t* p = session.periodic_batch.data() + at;
+    DoIPHeader header;
+    header.version = 2;
+    header.inverse_version = ~2;
+    header.payload_type = htons(0x8001);
+    header.payload_length = htonl(4 + uds_size);
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(DoIPHeader);
+    put_be16(p, link.cfg.logical_address);
+    put_be16(p + 2, session.tester_address);
+    p[4] = 0x62;
+    p[5] = 0xF2;
+    memcpy(p + 6, data, len);
+    link.periodic_records++;
+
+    if (g_config.periodic_flush_ms <= 0 || session.periodic_batch.size() >= PERIODIC_BATCH_MAX) {
+        periodic_flush(session);
+    }
+    else if (session.periodic_timer == 0) {
+        uint64_t session_id = session.id;
+        session.periodic_timer = g_reactor.add_timer_ms(g_config.periodic_flush_ms, [session_id]() {
+            auto it = g_sessions.find(session_id);
+            if (it == g_sessions.end()) return;
+            it->second->periodic_timer = 0;
+            periodic_flush(*it->second);
+        });
+    }
+    return true;
+}
 
-        if (!session_active || total_received != payload_length) {
-            std::cerr << "페이로드를 완전히 수신하지 못했습니다. (기대: " << payload_length << ", 실제: " << total_received << ")" << std::endl;
-            break;
-        }
+void periodic_flush(DoipSession& session) {
+    g_reactor.cancel_timer(session.periodic_timer);
+    if (session.periodic_batch.empty()) return;
+    session_send(session, std::move(session.periodic_batch));
+    session.periodic_batch.clear();
+}
 
+// --- 플래시 다운로드 가속 ---
+// 진단기는 0x34 → 0x74 이후 이미지를 DOIP_TYPE_FLASH_STREAM 메시지로 끊김 없이 보내고,
+// 게이트웨이가 maxNumberOfBlockLength 단위의 0x36 블록으로 나눠 ECU와 주고받은 뒤 0x37로 마무리합니다.
+// 블록 하나가 버스에 있는 동안 다음 블록을 미리 만들어 두고(더블 버퍼링), 0x76이 오면 바로 보냅니다.
+// 진단기에는 0x37 응답(또는 첫 부정 응답/NACK) 하나만 돌아갑니다.
+void flash_on_request_download(IsoTpLink& link, uint64_t session_id, const std::vector<uint8_t>& uds_request) {
+    flash_reset(link);
+    // [0x34][dataFormatIdentifier][addressAndLengthFormatIdentifier][memoryAddress][memorySize]
+    if (uds_request.size() < 3) return;
+    size_t size_len = uds_request[2] >> 4;
+    size_t addr_len = uds_request[2] & 0x0F;
+    if (size_len == 0 || size_len > 4 || uds_request.size() < 3 + addr_len + size_len) return;
+
+    size_t total = 0;
+    for (size_t i = 0; i < size_len; ++i) total = (total << 8) | uds_request[3 + addr_len + i];
+    link.flash.session_id = session_id;
+    link.flash.total = total;
+}
 
-        if (payload_type == 0x0005) { // 라우팅 활성화 요청
-            std::cout << "라우팅 활성화 요청 수신. 긍정 응답 전송." << std::endl;
-            std::vector<uint8_t> resp(sizeof(DoIPHeader) + 9);
-            DoIPHeader* resp_header = (DoIPHeader*)resp.data();
-            resp_header->version = 2;
-            resp_header->inverse_version = ~2;
-            resp_header->payload_type = htons(0x0006); // 긍정 응답 타입
-            resp_header->payload_length = htonl(9);    // 페이로드 길이 9
+void flash_on_download_accepted(IsoTpLink& link, const UdsMessage& uds_response) {
+    FlashDownload& f = link.flash;
+    if (f.session_id == 0 || f.session_id != link.owner_session || uds_response.size() < 2) return;
+    // [0x74][lengthFormatIdentifier][maxNumberOfBlockLength]
+    size_t len_len = uds_response[1] >> 4;
+    if (len_len == 0 || len_len > 4 || uds_response.size() < 2 + len_len) return;
+
+    size_t max_block = 0;
+    for (size_t i = 0; i < len_len; ++i) max_block = (max_block << 8) | uds_response[2 + i];
+    if (max_block <= 2) return;
+    f.block_data_len = std::min(max_block, ISOTP_MAX_PDU) - 2;
+    f.streaming = true;
+    f.started = Clock::now();
+    flash_arm_idle_timer(link);
+    std::cout << "[Flash] " << link.cfg.name << " 다운로드 준비: " << f.total << " 바이트, 블록당 "
+              << f.block_data_len << " 바이트" << std::endl;
+}
 
-            // 페이로드 구성
-            uint16_t* client_addr_ptr = (uint16_t*)(resp.data() + sizeof(DoIPHeader));
-            uint16_t* server_addr_ptr = (uint16_t*)(resp.data() + sizeof(DoIPHeader) + 2);
-            uint8_t* response_code_ptr = (uint8_t*)(resp.data() + sizeof(DoIPHeader) + 4);
+void flash_on_stream(DoipSession& session, const uint8_t* payload, uint32_t payload_length) {
+    if (payload_length < 4) return;
+    uint16_t target_address = (payload[2] << 8) | payload[3];
+    auto link_it = g_links.find(target_address);
+    if (link_it == g_links.end()) {
+        send_diagnostic_nack(session, target_address, 0x03); // 0x03: Unknown target address
+        return;
+    }
+    IsoTpLink& link = link_it->second;
+    FlashDownload& f = link.flash;
+    if (f.session_id != session.id || !f.streaming || f.exit_sent) {
+        // RequestDownload가 수락되지 않은 상태의 TransferData와 같으므로 ECU처럼 requestSequenceError로 답함
+        send_diagnostic_message(session, target_address, { 0x7F, 0x36, 0x24 });
+        return;
+    }
 
-            *client_addr_ptr = htons(CLIENT_LOGICAL_ADDRESS); // 클라이언트 주소
-            *server_addr_ptr = htons(SERVER_LOGICAL_ADDRESS); // 서버(ECU) 주소
-            *response_code_ptr = 0x10; // 0x10: 성공적으로 활성화됨
+    size_t len = std::min((size_t)(payload_length - 4), f.total - f.received);
+    if (len < payload_length - 4) {
+        std::cerr << "[Flash] memorySize를 넘는 데이터 " << (payload_length - 4 - len) << " 바이트를 버립니다." << std::endl;
+    }
+    f.stream.insert(f.stream.end(), payload + 4, payload + 4 + len);
+    f.received += len;
+    if (f.received < f.total) flash_arm_idle_timer(link);
+    else g_reactor.cancel_timer(f.idle_timer); // 이후는 ECU 쪽 P2/P2*가 감시
+    flash_pump(link);
+}
 
-            // 응답 전송
-            {
-                std::lock_guard<std::mutex> lock(client_socket_mutex);
-                write(client_sock, resp.data(), resp.size());
-            }
-            continue;
-        }
+// 진단기가 memorySize를 다 보내기 전에 스트림을 멈추면 가속기가 채널을 계속 붙잡지 않도록 중단합니다.
+void flash_arm_idle_timer(IsoTpLink& link) {
+    g_reactor.cancel_timer(link.flash.idle_timer);
+    link.flash.idle_timer = g_reactor.add_timer_ms(FLASH_STREAM_IDLE_MS, [&link]() {
+        link.flash.idle_timer = 0;
+        flash_on_stream_idle(link);
+    });
+}
 
-        if (payload_type != 0x8001) continue;
+void flash_on_stream_idle(IsoTpLink& link) {
+    FlashDownload& f = link.flash;
+    if (!f.streaming || f.received >= f.total) return;
+    // 게이트웨이가 읽기를 멈춘 상태(블록 두 개분이 쌓임)라면 진단기 잘못이 아니므로 다시 기다림
+    if (f.stream.size() - f.stream_offset >= 2 * f.block_data_len) {
+        flash_arm_idle_timer(link);
+        return;
+    }
+    std::cerr << "[Flash] " << link.cfg.name << " 이미지 스트림이 " << FLASH_STREAM_IDLE_MS << "ms 동안 끊김 ("
+              << f.received << "/" << f.total << " 바이트)." << std::endl;
+    flash_abort(link, 0x08); // 0x08: Transport protocol error
+    dispatch_next_request(link);
+}
 
-        // DoIP ACK(0x8002) 전송
-        std::vector<uint8_t> ack_msg(sizeof(DoIPHeader) + 5);
-        DoIPHeader* ack_header = (DoIPHeader*)ack_msg.data();
-        ack_header->version = 2; ack_header->inverse_version = ~2;
-        ack_header->payload_type = htons(0x8002);
-        ack_header->payload_length = htonl(5);
-        // ACK 페이로드 구성
-        uint16_t* ack_sa = (uint16_t*)(ack_msg.data() + sizeof(DoIPHeader));
-        uint16_t* ack_ta = (uint16_t*)(ack_msg.data() + sizeof(DoIPHeader) + 2);
-        uint8_t* ack_code = (uint8_t*)(ack_msg.data() + sizeof(DoIPHeader) + 4);
-        *ack_sa = htons(SERVER_LOGICAL_ADDRESS); // 요청을 받은 주체 (ECU)
-        *ack_ta = htons(CLIENT_LOGICAL_ADDRESS); // 요청을 보낸 주체 (진단기)
-        *ack_code = 0x00;                        // 0x00: Positive ACK (정상 수신)
+void flash_pump(IsoTpLink& link) {
+    FlashDownload& f = link.flash;
+    if (!f.streaming) return;
 
-        {
-            std::lock_guard<std::mutex> lock(client_socket_mutex);
-            write(client_sock, ack_msg.data(), ack_msg.size());
+    while (true) {
+        // 다음 블록 미리 만들기
+        size_t want = std::min(f.block_data_len, f.total - f.queued);
+        if (f.next_block.empty() && want > 0 && f.stream.size() - f.stream_offset >= want) {
+            f.next_block = request_buffer_acquire(link);
+            f.next_block.reserve(want + 2);
+            f.next_block.push_back(0x36);
+            f.next_block.push_back(f.block_counter++); // 0xFF 다음은 0x00으로 순환
+            f.next_block.insert(f.next_block.end(), f.stream.begin() + f.stream_offset,
+                                f.stream.begin() + f.stream_offset + want);
+            f.next_block_len = want;
+            f.stream_offset += want;
+            f.queued += want;
+            if (f.stream_offset * 2 >= f.stream.size()) { // 앞쪽 소비분 정리
+                f.stream.erase(f.stream.begin(), f.stream.begin() + f.stream_offset);
+                f.stream_offset = 0;
+            }
         }
-        std::cout << "\nDoIP: Positive ACK (0x8002) 전송 완료" << std::endl; // 확인용 로그
-
-
-        // DoIP 페이로드에서 SA, TA를 제외한 순수 UDS 데이터 추출
-        std::vector<uint8_t> uds_request(payload_buffer.begin() + 4, payload_buffer.end());
-        std::cout << "\n[DoIP -> CAN] DoIP로부터 UDS 요청 수신 (" << uds_request.size() << " 바이트)" << std::endl;
-
-        isotp_send(can_sock, UDS_REQUEST_CAN_ID, uds_request);
+        if (f.block_in_flight) break;
+
+        if (!f.next_block.empty()) {
+            f.in_flight_len = f.next_block_len;
+            f.block_in_flight = true;
+            queue_request(link, PendingRequest{ f.session_id, std::move(f.next_block), true });
+            f.next_block.clear();
+            continue; // 방금 보낸 블록 다음 것을 미리 만듦
+        }
+        if (f.acked == f.total && !f.exit_sent) {
+            f.exit_sent = true;
+            f.block_in_flight = true;
+            queue_request(link, PendingRequest{ f.session_id, { 0x37 }, true });
+        }
+        break;
     }
 
-    session_active = false;
-    fc_queue_cv.notify_all(); // CV 변수명 변경
-    if (can_reader.joinable()) {
-        can_reader.join();
+    // 현재 블록과 다음 블록만큼 쌓이면 진단기 소켓 읽기를 멈춰 메모리 사용을 묶어 둡니다.
+    auto it = g_sessions.find(f.session_id);
+    if (it != g_sessions.end()) {
+        session_set_rx_paused(*it->second, f.stream.size() - f.stream_offset >= 2 * f.block_data_len);
     }
-    close(can_sock);
+    dispatch_next_request(link);
 }
 
-// --- CAN 소켓 설정 함수 ---
-int setup_can_socket() {
-    int sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-    if (sock < 0) return -1;
-    ifreq ifr;
-    strcpy(ifr.ifr_name, CAN_INTERFACE);
-    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) return -1;
-    sockaddr_can addr;
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
-    can_filter rfilter[1];
-    rfilter[0].can_id = UDS_RESPONSE_CAN_ID;
-    rfilter[0].can_mask = CAN_SFF_MASK;
-    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, &rfilter, sizeof(rfilter));
-    struct timeval tv;
-    tv.tv_sec = 2; tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-    return sock;
-}
+void flash_on_ecu_response(IsoTpLink& link, UdsMessage uds_response) {
+    FlashDownload& f = link.flash;
+    if (f.session_id == 0 || !f.block_in_flight) return; // 세션이 끊긴 뒤 도착한 응답
+    f.block_in_flight = false;
 
-// // --- ISO-TP 송신 메인 함수 ---
-bool isotp_send(int sock, uint32_t can_id, const std::vector<uint8_t>& data) {
-    if (data.size() <= 7) {
-        return isotp_send_single_frame(sock, can_id, data);
+    if (!f.exit_sent && uds_response[0] == 0x76) {
+        f.acked += f.in_flight_len;
+        f.in_flight_len = 0;
+        flash_pump(link);
+        return;
+    }
+
+    if (uds_response[0] == 0x77) {
+        double secs = std::chrono::duration<double>(Clock::now() - f.started).count();
+        std::cout << "[Flash] " << link.cfg.name << " 다운로드 완료: " << f.total << " 바이트, " << secs << "초 ("
+                  << (secs > 0 ? f.total / secs / 1024 : 0) << " KiB/s)" << std::endl;
     }
     else {
-        return isotp_send_multi_frame(sock, can_id, data);
+        std::cerr << "[Flash] " << link.cfg.name << " ECU가 블록을 거부했습니다. 전송을 중단합니다." << std::endl;
     }
+    forward_response_to_tester(link, std::move(uds_response));
+    flash_reset(link);
 }
 
-bool isotp_send_single_frame(int sock, uint32_t can_id, const std::vector<uint8_t>& data) {
-    can_frame frame;
-    frame.can_id = can_id;
-    frame.can_dlc = data.size() + 1;
-    frame.data[0] = 0x00 | data.size();
-    memcpy(&frame.data[1], data.data(), data.size());
-
-    //write(sock, &frame, sizeof(frame));
-    if (write(sock, &frame, sizeof(frame)) <= 0) {
-        std::cerr << "Single Frame CAN 소켓 쓰기 실패." << std::endl;
-        return false;
+// 게이트웨이 쪽 오류(전송 실패, 응답 없음)는 DoIP NACK으로 알리고 남은 이미지를 버립니다.
+void flash_abort(IsoTpLink& link, uint8_t nack_code) {
+    auto it = g_sessions.find(link.flash.session_id);
+    if (link.flash.streaming && it != g_sessions.end()) {
+        std::cerr << "[Flash] " << link.cfg.name << " 다운로드 중단 (NACK 0x" << std::hex << (int)nack_code << std::dec << ")" << std::endl;
+        send_diagnostic_nack(*it->second, link.cfg.logical_address, nack_code);
     }
-    std::cout << "  -> CAN: Single Frame 전송" << std::endl;
-    return true;
+    flash_reset(link);
 }
 
-bool isotp_send_multi_frame(int sock, uint32_t can_id, const std::vector<uint8_t>& data) {
-    isotp_send_first_frame(sock, can_id, data);
+void flash_reset(IsoTpLink& link) {
+    auto it = g_sessions.find(link.flash.session_id);
+    if (it != g_sessions.end()) session_set_rx_paused(*it->second, false);
+    erase_pending_requests(link, link.flash.session_id, true);
+    g_reactor.cancel_timer(link.flash.idle_timer);
+    link.flash = FlashDownload();
+}
 
-    size_t bytes_sent = 6;
-    uint8_t seq_num = 1;
+// --- CAN 프레임 송신 ---
+// ECU별로 Classic(8바이트) 또는 FD(64바이트) 프레임을 씁니다. canfd_frame의 len은 can_dlc와 같은 자리라
+// Classic 링크는 앞 16바이트(CAN_MTU)만 쓰면 됩니다.
+size_t isotp_tx_dl(const IsoTpLink& link) {
+    return link.cfg.can_fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+}
 
-    while (bytes_sent < data.size()) {
-        if (!isotp_send_consecutive_frames(sock, can_id, data, &bytes_sent, &seq_num)) {
-            std::cerr << "Consecutive frame 전송 실패. 중단." << std::endl;
-            return false;
+// FD 프레임 길이는 0~8, 12, 16, 20, 24, 32, 48, 64 중 하나여야 하므로 남는 자리를 채웁니다.
+size_t can_prepare_frame(bool fd, canfd_frame& frame) {
+    if (!fd) return CAN_MTU;
+    static const uint8_t fd_lengths[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+    for (uint8_t len : fd_lengths) {
+        if (frame.len <= len) {
+            memset(&frame.data[frame.len], CAN_FD_PADDING, len - frame.len);
+            frame.len = len;
+            break;
         }
     }
+    frame.flags = CANFD_BRS;
+    return CANFD_MTU;
+}
 
-    std::cout << "  -> CAN: 모든 Multi-frame 데이터 전송 완료." << std::endl;
+size_t can_prepare_frame(const IsoTpLink& link, canfd_frame& frame) {
+    return can_prepare_frame(link.cfg.can_fd, frame);
+}
+
+bool can_write_frame(bool fd, canfd_frame& frame) {
+    size_t mtu = can_prepare_frame(fd, frame);
+    if (write(g_can_sock, &frame, mtu) != (ssize_t)mtu) return false;
+    trace_can(frame, mtu == CANFD_MTU, TRACE_TX);
     return true;
 }
 
-void isotp_send_first_frame(int sock, uint32_t can_id, const std::vector<uint8_t>& data) {
-    can_frame frame;
-    frame.can_id = can_id;
-    frame.can_dlc = 8;
-    frame.data[0] = 0x10 | ((data.size() >> 8) & 0x0F);
-    frame.data[1] = data.size() & 0xFF;
-    memcpy(&frame.data[2], data.data(), 6);
-    write(sock, &frame, sizeof(frame));
-    std::cout << "  -> CAN: First Frame 전송." << std::endl;
+bool can_write_frame(const IsoTpLink& link, canfd_frame& frame) {
+    return can_write_frame(link.cfg.can_fd, frame);
+}
+
+// // --- ISO-TP 송신 메인 함수 ---
+// 단일 프레임은 즉시 끝나고, 멀티 프레임은 FC/STmin 타이머를 따라 리액터에서 이어서 진행됩니다.
+// 요청 버퍼는 대기열에서 tx_data로 옮겨 오므로 (플래시 블록이면 최대 1MB) 복사하지 않습니다.
+bool isotp_send(IsoTpLink& link, std::vector<uint8_t> data_in) {
+    link.tx_data = std::move(data_in);
+    const std::vector<uint8_t>& data = link.tx_data;
+    link.last_request_at = Clock::now();
+    link.metrics.uds_tx_bytes += data.size();
+    if (link.isotp_sock >= 0) {
+        return isotp_kernel_send(link, data);
+    }
+    // SF 최대 길이: Classic 7바이트, FD는 SF_DL escape(바이트 0 = 0)로 TX_DL - 2 바이트
+    size_t sf_max = link.cfg.can_fd ? isotp_tx_dl(link) - 2 : 7;
+    if (data.size() <= sf_max) {
+        bool ok = isotp_send_single_frame(link, data);
+        isotp_finish_tx(link, ok);
+        return ok;
+    }
+
+    if (!isotp_send_first_frame(link, data)) {
+        isotp_finish_tx(link, false);
+        return false;
+    }
+    link.tx_seq = 1;
+    link.tx_pacing = PacingStats();
+    isotp_wait_flow_control(link);
+    return true;
 }
 
-bool isotp_send_consecutive_frames(int sock, uint32_t can_id, const std::vector<uint8_t>& data, size_t* bytes_sent, uint8_t* seq_num) {
-    can_frame fc_frame;
+bool isotp_send_single_frame(IsoTpLink& link, const std::vector<uint8_t>& data) {
+    canfd_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = link.cfg.tx_id;
+    if (data.size() <= 7) {
+        frame.len = data.size() + 1;
+        frame.data[0] = 0x00 | data.size();
+        memcpy(&frame.data[1], data.data(), data.size());
+    }
+    else { // CAN FD SF: [0x00][SF_DL][데이터...]
+        frame.len = data.size() + 2;
+        frame.data[0] = 0x00;
+        frame.data[1] = data.size();
+        memcpy(&frame.data[2], data.data(), data.size());
+    }
 
-    std::cout << "  -> FC 대기 중..." << std::endl;
+    if (!can_write_frame(link, frame)) {
+        std::cerr << "Single Frame CAN 소켓 쓰기 실패." << std::endl;
+        return false;
+    }
+    if (g_config.log_messages) std::cout << "  -> CAN: Single Frame 전송" << std::endl;
+    return true;
+}
 
-    // 1. CAN 리더 스레드가 전달해 줄 FC 프레임을 기다립니다.
-    if (!wait_for_flow_control(fc_frame)) {
-        return false; // 타임아웃 또는 오류
+// 4095 바이트 이하는 12비트 FF_DL, 그보다 길면 FF_DL=0 뒤에 32비트 길이를 싣는 escape 형식
+// (ISO 15765-2:2016)을 씁니다. 헤더 길이만큼 tx_offset을 설정합니다.
+bool isotp_send_first_frame(IsoTpLink& link, const std::vector<uint8_t>& data) {
+    const size_t tx_dl = isotp_tx_dl(link);
+    canfd_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = link.cfg.tx_id;
+    frame.len = tx_dl;
+
+    size_t header_len;
+    if (data.size() <= ISOTP_FF_DL_12BIT_MAX) {
+        frame.data[0] = 0x10 | ((data.size() >> 8) & 0x0F);
+        frame.data[1] = data.size() & 0xFF;
+        header_len = 2;
+    }
+    else {
+        uint32_t ff_dl = htonl(data.size());
+        frame.data[0] = 0x10;
+        frame.data[1] = 0x00;
+        memcpy(&frame.data[2], &ff_dl, 4);
+        header_len = 6;
+    }
+    memcpy(&frame.data[header_len], data.data(), tx_dl - header_len);
+    if (!can_write_frame(link, frame)) {
+        std::cerr << "First Frame CAN 소켓 쓰기 실패." << std::endl;
+        return false;
     }
+    link.tx_offset = tx_dl - header_len;
+    if (g_config.log_messages) std::cout << "  -> CAN: First Frame 전송 (" << data.size() << " 바이트"
+              << (header_len == 6 ? ", escape FF_DL" : "") << ")." << std::endl;
+    return true;
+}
+
+void isotp_on_flow_control(IsoTpLink& link, const canfd_frame& fc_frame) {
+    if (link.tx_state != IsoTpTxState::WAIT_FC) return; // 기다리지 않던 FC는 무시
 
-    // 2. 수신된 FC 프레임의 파라미터를 분석합니다.
+    // 수신된 FC 프레임의 파라미터를 분석합니다.
     uint8_t fs = fc_frame.data[0] & 0x0F;
     uint8_t bs = fc_frame.data[1];
     uint8_t stmin_raw = fc_frame.data[2];
 
-    // 3. Flow Status에 따라 동작을 결정합니다.
+    g_reactor.cancel_timer(link.tx_timer);
+
+    // Flow Status에 따라 동작을 결정합니다.
     if (fs == 1) { // Wait
-        std::cout << "  <- CAN: FC(Wait) 수신. 잠시 후 재시도합니다." << std::endl;
-        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // 잠시 대기
-        return true; // true를 반환하여 바깥 루프가 재시도하도록 함
+        if (g_config.log_messages) std::cout << "  <- CAN: FC(Wait) 수신. 다음 FC를 기다립니다." << std::endl;
+        isotp_arm_fc_timeout(link);
+        return;
     }
+    link.metrics.fc_wait.observe(std::chrono::duration<double>(Clock::now() - link.fc_wait_started).count());
     if (fs > 1) { // Overflow 또는 예약된 값
         std::cerr << "  <- CAN: FC(Overflow) 수신. 전송을 중단합니다." << std::endl;
-        return false; // false를 반환하여 전송 완전 중단
+        isotp_finish_tx(link, false);
+        return;
     }
 
-    std::cout << "  <- CAN: FC(Continue) 수신. CF 블록 전송을 시작합니다." << std::endl;
+    if (g_config.log_messages) std::cout << "  <- CAN: FC(Continue) 수신. CF 블록 전송을 시작합니다." << std::endl;
 
-    // 4. STmin(프레임 간 최소 시간)을 계산합니다.
-    long stmin_us = 0;
+    // STmin(프레임 간 최소 시간)을 계산합니다.
+    link.tx_stmin_us = 0;
     if (stmin_raw <= 0x7F) {
-        stmin_us = stmin_raw * 1000;
+        link.tx_stmin_us = stmin_raw * 1000;
     }
     else if (stmin_raw >= 0xF1 && stmin_raw <= 0xF9) {
-        stmin_us = (stmin_raw - 0xF0) * 100;
+        link.tx_stmin_us = (stmin_raw - 0xF0) * 100;
     }
 
-    // 5. 이번 블록에서 보낼 프레임 수를 결정하고 전송합니다.
-    uint16_t frames_to_send_in_block = (bs == 0) ? MAX_CONSECUTIVE_FRAMES_IN_BLOCK : bs;
-    uint16_t frames_sent_in_block = 0;
+    link.tx_block_size = bs;
+    link.tx_block_sent = 0;
+    link.tx_state = IsoTpTxState::SENDING_CF;
+    isotp_send_consecutive_frames(link);
+}
 
-    while (frames_sent_in_block < frames_to_send_in_block && *bytes_sent < data.size()) {
-        can_frame cf_frame;
-        cf_frame.can_id = can_id;
-        cf_frame.data[0] = 0x20 | (*seq_num & 0x0F);
+// 현재 블록의 CF를 보냅니다.
+// STmin > 0: 직전 CF 송신 시각 + STmin 을 절대 마감시각으로 잡아 timerfd로 깨어나고,
+//            마지막 STMIN_SPIN_US 구간은 바쁜 대기로 맞춥니다 (sleep_for의 누적 지연 제거).
+// STmin = 0: 블록을 sendmmsg()로 묶어 한 번의 시스템 콜에 여러 프레임을 보냅니다.
+void isotp_send_consecutive_frames(IsoTpLink& link) {
+    const std::vector<uint8_t>& data = link.tx_data;
+
+    while (link.tx_offset < data.size() &&
+           (link.tx_block_size == 0 || link.tx_block_sent < link.tx_block_size)) {
+        // 블록의 첫 CF는 FC 직후 바로 보내고, 이후 CF는 STmin 마감시각까지 기다립니다.
+        bool paced = link.tx_stmin_us > 0 && link.tx_block_sent > 0;
+        if (paced && !isotp_wait_until(link, link.tx_last_cf_time + std::chrono::microseconds(link.tx_stmin_us))) {
+            return; // 타이머가 예약됨
+        }
 
-        size_t bytes_to_send_in_frame = std::min((size_t)7, data.size() - *bytes_sent);
-        memcpy(&cf_frame.data[1], data.data() + *bytes_sent, bytes_to_send_in_frame);
-        cf_frame.can_dlc = bytes_to_send_in_frame + 1;
+        const size_t cf_payload = isotp_tx_dl(link) - 1;
+        size_t frames_left = (data.size() - link.tx_offset + cf_payload - 1) / cf_payload;
+        if (link.tx_block_size != 0) {
+            frames_left = std::min(frames_left, (size_t)(link.tx_block_size - link.tx_block_sent));
+        }
+        size_t batch = (link.tx_stmin_us == 0) ? std::min(frames_left, CF_BURST_MAX) : 1;
+
+        canfd_frame cf_frames[CF_BURST_MAX];
+        size_t cf_bytes[CF_BURST_MAX];
+        mmsghdr msgs[CF_BURST_MAX];
+        iovec iovs[CF_BURST_MAX];
+        size_t offset = link.tx_offset;
+        uint8_t seq = link.tx_seq;
+        for (size_t i = 0; i < batch; ++i) {
+            canfd_frame& cf_frame = cf_frames[i];
+            memset(&cf_frame, 0, sizeof(cf_frame));
+            cf_frame.can_id = link.cfg.tx_id;
+            cf_frame.data[0] = 0x20 | (seq & 0x0F);
+
+            size_t bytes_to_send_in_frame = std::min(cf_payload, data.size() - offset);
+            memcpy(&cf_frame.data[1], data.data() + offset, bytes_to_send_in_frame);
+            cf_frame.len = bytes_to_send_in_frame + 1;
+            cf_bytes[i] = bytes_to_send_in_frame;
+
+            iovs[i].iov_base = &cf_frame;
+            iovs[i].iov_len = can_prepare_frame(link, cf_frame);
+            memset(&msgs[i], 0, sizeof(mmsghdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+
+            offset += bytes_to_send_in_frame;
+            seq = (seq + 1) % 16;
+        }
 
-        if (write(sock, &cf_frame, sizeof(can_frame)) <= 0) {
+        int sent = (batch == 1) ? (write(g_can_sock, &cf_frames[0], iovs[0].iov_len) == (ssize_t)iovs[0].iov_len ? 1 : -1)
+                                : sendmmsg(g_can_sock, msgs, batch, 0);
+        if (sent <= 0) {
+            if (errno == ENOBUFS || errno == EAGAIN) {
+                // 컨트롤러 송신 큐가 가득 참: 같은 프레임을 잠시 후 다시 보냄
+                link.tx_timer = g_reactor.add_timer_ms(CAN_TX_RETRY_MS, [&link]() {
+                    link.tx_timer = 0;
+                    isotp_send_consecutive_frames(link);
+                });
+                return;
+            }
             std::cerr << "CF 프레임 CAN 소켓 쓰기 실패." << std::endl;
-            return false;
+            isotp_finish_tx(link, false);
+            return;
         }
 
-        *bytes_sent += bytes_to_send_in_frame;
-        *seq_num = (*seq_num + 1) % 16;
-        frames_sent_in_block++;
+        Clock::time_point now = Clock::now();
+        if (paced) {
+            long gap_us = std::chrono::duration_cast<std::chrono::microseconds>(now - link.tx_last_cf_time).count();
+            link.tx_pacing.record(gap_us - link.tx_stmin_us);
+            link.metrics.stmin_wait_seconds += gap_us / 1e6;
+        }
+        link.tx_last_cf_time = now;
 
-        // 마지막 프레임이 아니라면 STmin 만큼 대기합니다.
-        if (*bytes_sent < data.size()) {
-            std::this_thread::sleep_for(std::chrono::microseconds(stmin_us));
+        // 일부만 나갔으면(송신 큐 포화) 나간 만큼만 진행하고 나머지는 다음 반복에서 다시 보냄
+        for (int i = 0; i < sent; ++i) {
+            link.tx_offset += cf_bytes[i];
+            trace_can(cf_frames[i], iovs[i].iov_len == CANFD_MTU, TRACE_TX);
         }
+        link.tx_seq = (link.tx_seq + sent) % 16;
+        link.tx_block_sent += sent;
     }
 
-    return true; // 블록 전송 성공
-}
-
-bool wait_for_flow_control(can_frame& fc_frame_out) {
-    std::vector<uint8_t> local_fc_frame_data;
-    {
-        // --- FC 대기 로직 변경 ---
-        // condition variable과 predicate을 확인하는 대신, queue가 비어있지 않을 때까지 기다립니다.
-        std::unique_lock<std::mutex> lock(fc_queue_mutex);
-        if (!fc_queue_cv.wait_for(lock, std::chrono::seconds(2), [] { return !fc_frame_queue.empty(); })) {
-            std::cerr << "FC 수신 타임아웃!" << std::endl;
-            return false;
+    if (link.tx_offset >= data.size()) {
+        if (g_config.log_messages) std::cout << "  -> CAN: 모든 Multi-frame 데이터 전송 완료." << std::endl;
+        if (g_config.log_messages && link.tx_pacing.frames > 0) {
+            std::cout << "  -> STmin " << link.tx_stmin_us << "us 페이싱: " << link.tx_pacing.frames
+                      << "프레임, 평균 지연 " << link.tx_pacing.mean_late_us() << "us, 최대 지연 "
+                      << link.tx_pacing.max_late_us << "us" << std::endl;
         }
-        local_fc_frame_data = fc_frame_queue.front();
-        fc_frame_queue.pop();
+        isotp_finish_tx(link, true);
+        return;
     }
 
-    if (local_fc_frame_data.empty() || (local_fc_frame_data[0] & 0xF0) != 0x30) {
-        std::cerr << "FC 큐에서 잘못된 데이터 수신." << std::endl;
+    // 블록을 다 보냈으므로 다음 FC를 기다립니다.
+    isotp_wait_flow_control(link);
+}
+
+void isotp_wait_flow_control(IsoTpLink& link) {
+    link.tx_state = IsoTpTxState::WAIT_FC;
+    link.fc_wait_started = Clock::now();
+    link.metrics.fc_waits++;
+    if (g_config.log_messages) std::cout << "  -> FC 대기 중..." << std::endl;
+    isotp_arm_fc_timeout(link);
+}
+
+void isotp_arm_fc_timeout(IsoTpLink& link) {
+    link.tx_timer = g_reactor.add_timer_ms(FC_TIMEOUT_MS, [&link]() {
+        link.tx_timer = 0;
+        link.metrics.fc_timeouts++;
+        std::cerr << "FC 수신 타임아웃!" << std::endl;
+        isotp_finish_tx(link, false);
+    });
+}
+
+// 마감시각이 지났으면 true. 아직 멀었으면 마감 STMIN_SPIN_US 전에 깨어나도록 타이머를 걸고 false,
+// 그 이내면 마감까지 바쁜 대기 후 true를 돌려줍니다.
+bool isotp_wait_until(IsoTpLink& link, Clock::time_point deadline) {
+    Clock::time_point now = Clock::now();
+    if (now >= deadline) return true;
+
+    auto spin = std::chrono::microseconds(g_config.stmin_spin_us);
+    if (deadline - now > spin) {
+        link.tx_timer = g_reactor.add_timer(deadline - spin, [&link]() {
+            link.tx_timer = 0;
+            isotp_send_consecutive_frames(link);
+        });
         return false;
     }
+    while (Clock::now() < deadline) {}
+    link.metrics.stmin_spin_seconds += std::chrono::duration<double>(Clock::now() - now).count();
+    return true;
+}
+
+// 송신이 끝나면(성공/실패) 응답 대기로 넘어가거나 다음 요청을 진행합니다.
+void isotp_finish_tx(IsoTpLink& link, bool ok) {
+    g_reactor.cancel_timer(link.tx_timer);
+    link.tx_state = IsoTpTxState::IDLE;
+    if (!ok) std::cerr << "Consecutive frame 전송 실패. 중단." << std::endl;
+    if (!ok && link.owner_flash) flash_abort(link, 0x08); // 0x08: Transport protocol error
+
+    if (ok && expects_response(link.tx_data)) response_timing_start(link);
+    request_buffer_release(link, link.tx_data);
+    isotp_fc_try_reopen(link);
+
+    // 같은 호출 스택에서 재귀적으로 다음 요청을 보내지 않도록 리액터에 한 번 양보
+    g_reactor.add_timer(Clock::now(), [&link]() { dispatch_next_request(link); });
+}
+
+// --- 응답 타이밍 (P2/P2*) ---
+// 요청 송신 완료 → P2 안에 응답(또는 FF)이 없으면 바로 실패 처리하고 채널을 넘깁니다.
+// 0x78을 받을 때마다 마감을 P2*로 다시 잡고, 최종 응답까지의 시간을 SID별 히스토그램에 기록합니다.
+// FF를 받으면 이후 감시는 CF 타임아웃(N_Cr)이 맡습니다.
+void response_timing_start(IsoTpLink& link) {
+    link.awaiting_response = true;
+    link.request_sent_at = Clock::now();
+    link.pending_responses = 0;
+    response_timing_arm(link, link.p2_ms);
+}
+
+void response_timing_on_pending(IsoTpLink& link) {
+    link.pending_responses++;
+    link.metrics.response_pending++;
+    response_timing_arm(link, link.p2_star_ms);
+}
+
+// 커널 백엔드는 FF를 보여주지 않아 재조립 시작 시점을 알 수 없습니다. 그래서 P2 대신
+// P2* + (커널이 받을 수 있는 가장 긴 응답을 지금 FC STmin으로 받는 시간)을 최종 마감으로 씁니다.
+// 재조립 중 CF가 끊기면 커널이 N_Cr 오류(EPOLLERR)로 먼저 알려 줍니다.
+void response_timing_arm(IsoTpLink& link, int base_ms) {
+    int deadline_ms = base_ms;
+    if (link.isotp_sock >= 0) {
+        const size_t cf_payload = link.cfg.can_fd ? CANFD_MAX_DLEN - 1 : CAN_MAX_DLEN - 1;
+        const size_t frames = (KERNEL_ISOTP_MAX_PDU + cf_payload - 1) / cf_payload;
+        const uint8_t stmin = link.rx_fc_stmin;
+        const int stmin_ms = stmin <= 0x7F ? std::max<int>(stmin, 1) : 1; // 0, 100~900us도 프레임당 1ms로 잡음
+        deadline_ms = std::max(base_ms, link.p2_star_ms) + (int)(frames * stmin_ms);
+    }
+    link.response_deadline_ms = deadline_ms;
+    g_reactor.cancel_timer(link.response_timer);
+    link.response_timer = g_reactor.add_timer_ms(deadline_ms, [&link]() { response_timing_expired(link); });
+}
 
-    // 유효한 FC 프레임 데이터를 can_frame 구조체로 복사
-    memset(&fc_frame_out, 0, sizeof(can_frame));
-    fc_frame_out.can_dlc = local_fc_frame_data.size();
-    memcpy(fc_frame_out.data, local_fc_frame_data.data(), local_fc_frame_data.size());
+// 0x50 긍정 응답 [50][세션][P2 ms 2바이트][P2* 10ms 단위 2바이트]의 값으로 이후 마감을 맞춥니다.
+void response_timing_on_session(IsoTpLink& link, const UdsMessage& uds_response) {
+    if (link.cfg.timing_fixed || uds_response.size() < 6 || uds_response[0] != 0x50) return;
+    int p2 = (uds_response[2] << 8) | uds_response[3];
+    int p2_star = ((uds_response[4] << 8) | uds_response[5]) * 10;
+    if (p2 == 0 || p2_star == 0) return;
+    if (p2 + P2_MARGIN_MS != link.p2_ms || p2_star + P2_MARGIN_MS != link.p2_star_ms) {
+        std::cout << link.cfg.name << ": ECU 타이밍 P2=" << p2 << "ms, P2*=" << p2_star << "ms 적용" << std::endl;
+    }
+    link.p2_ms = p2 + P2_MARGIN_MS;
+    link.p2_star_ms = p2_star + P2_MARGIN_MS;
+}
 
-    return true;
+// 마감이 지난 요청은 포기하고, 진단기가 자기 타임아웃까지 기다리지 않도록 NRC를 대신 돌려줍니다.
+// 그 뒤 늦게 온 ECU 응답은 isotp_on_message에서 버립니다 (다음 요청의 응답으로 밀리지 않도록).
+void response_timing_expired(IsoTpLink& link) {
+    link.response_timer = 0;
+    link.awaiting_response = false;
+    link.inflight_expired = true;
+    if (link.pending_responses == 0) {
+        link.metrics.p2_timeouts++;
+        std::cerr << link.cfg.name << ": P2(" << link.response_deadline_ms << "ms) 안에 응답 없음. 다음 요청으로 넘어갑니다." << std::endl;
+    }
+    else {
+        link.metrics.p2_star_timeouts++;
+        std::cerr << link.cfg.name << ": 0x78 " << link.pending_responses << "회 이후 P2*(" << link.response_deadline_ms
+                  << "ms) 안에 응답 없음. 다음 요청으로 넘어갑니다." << std::endl;
+    }
+    if (link.owner_flash) {
+        flash_abort(link, 0x06); // 0x06: Target unreachable
+    }
+    else {
+        auto it = g_sessions.find(link.owner_session);
+        if (it != g_sessions.end())
+            send_diagnostic_message(*it->second, link.cfg.logical_address, { 0x7F, link.inflight_sid, NRC_RESPONSE_TIMEOUT });
+    }
+    dispatch_next_request(link);
 }
 
+// 최종 응답/NRC/0x78이 진행 중인 요청의 것인지: [SID + 0x40 ...] 또는 [7F SID NRC]
+bool response_matches_inflight(const IsoTpLink& link, const UdsMessage& uds_response) {
+    if (link.inflight_expired || uds_response.empty()) return false;
+    if (uds_response[0] == 0x7F) return uds_response.size() >= 3 && uds_response[1] == link.inflight_sid;
+    return uds_response[0] == (uint8_t)(link.inflight_sid + 0x40);
+}
 
+// --- 커널 ISO-TP 백엔드 ---
+// 논블로킹 write()는 FF(또는 SF)를 내보낸 직후 돌아오고, 전송이 끝나면 소켓이 EPOLLOUT이 됩니다.
+bool isotp_kernel_send(IsoTpLink& link, const std::vector<uint8_t>& data) {
+    ssize_t n = write(link.isotp_sock, data.data(), data.size());
+    if (n != (ssize_t)data.size()) {
+        std::cerr << link.cfg.name << ": CAN_ISOTP 소켓 쓰기 실패 (" << strerror(errno) << ")" << std::endl;
+        isotp_finish_tx(link, false);
+        return false;
+    }
+    if (g_config.log_messages) std::cout << "  -> CAN(isotp): " << data.size() << " 바이트 전송 시작" << std::endl;
+    link.tx_state = IsoTpTxState::IN_KERNEL;
+    g_reactor.modify(link.isotp_sock, EPOLLIN | EPOLLOUT);
+    return true;
+}
 
+void on_isotp_socket_event(IsoTpLink& link, uint32_t events) {
+    // 이 함수가 끝날 때까지 같은 소켓을 읽어야 하므로 FC 소켓 재생성은 마지막으로 미룹니다.
+    link.isotp_in_event = true;
+    if (events & EPOLLERR) {
+        // FC 타임아웃, CF 순서 오류 등 커널이 보고한 프로토콜 오류
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(link.isotp_sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        std::cerr << link.cfg.name << ": CAN_ISOTP 오류 (" << strerror(err) << ")" << std::endl;
+        if (link.tx_state == IsoTpTxState::IN_KERNEL) {
+            g_reactor.modify(link.isotp_sock, EPOLLIN);
+            isotp_finish_tx(link, false);
+        }
+        else {
+            // 커널이 재조립하던 응답이 깨졌으므로 최종 마감을 기다리지 않고 지금 요청을 실패 처리
+            g_reactor.cancel_timer(link.response_timer);
+            isotp_abort_rx(link, "커널 ISO-TP 수신 실패");
+            isotp_fc_backoff(link, strerror(err));
+        }
+    }
 
+    if ((events & EPOLLOUT) && link.tx_state == IsoTpTxState::IN_KERNEL) {
+        if (g_config.log_messages) std::cout << "  -> CAN(isotp): 전송 완료" << std::endl;
+        g_reactor.modify(link.isotp_sock, EPOLLIN);
+        isotp_finish_tx(link, true);
+    }
 
-// --- ISO-TP 수신 메인 함수 ---
-std::vector<uint8_t> isotp_receive(int sock) {
-    can_frame rx_frame;
-    if (read(sock, &rx_frame, sizeof(can_frame)) <= 0) {
-        return {}; // 타임아웃 또는 읽기 실패
+    if (events & EPOLLIN) {
+        // escape FF로 받은 큰 메시지도 한 번에 읽도록 DoIP 한도만큼의 공용 버퍼를 씁니다.
+        static std::vector<uint8_t> buf(ISOTP_MAX_PDU);
+        while (true) {
+            ssize_t n = read(link.isotp_sock, buf.data(), buf.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            if (g_config.log_messages) std::cout << "  <- CAN(isotp): " << n << " 바이트 수신" << std::endl;
+            if (n > 7) isotp_fc_on_success(link);
+            isotp_on_message(link, UdsMessage(buf.data(), n));
+        }
     }
+    link.isotp_in_event = false;
+    isotp_fc_try_reopen(link);
+}
+
+
+
 
+
+// --- ISO-TP 수신 메인 함수 ---
+void isotp_on_frame(IsoTpLink& link, const canfd_frame& rx_frame) {
     uint8_t pci_type = (rx_frame.data[0] & 0xF0) >> 4;
     switch (pci_type) {
-    case 0: // Single Frame
-        return isotp_handle_single_frame(rx_frame);
+    case 0: { // Single Frame
+        UdsMessage uds_response = isotp_handle_single_frame(rx_frame);
+        if (!uds_response.empty()) isotp_on_message(link, std::move(uds_response));
+        break;
+    }
     case 1: // First Frame
-        return isotp_handle_multi_frame(sock, rx_frame);
-    default: // Consecutive 또는 FlowControl 등, 첫 프레임으로 올 수 없음
+        isotp_handle_first_frame(link, rx_frame);
+        break;
+    case 2: // Consecutive Frame
+        isotp_handle_consecutive_frame(link, rx_frame);
+        break;
+    case 3: // Flow Control 프레임 (우리 송신에 대한 ECU의 응답)
+        isotp_on_flow_control(link, rx_frame);
+        break;
+    default:
         std::cerr << "잘못된 시작 프레임 수신 (Type: " << (int)pci_type << ")" << std::endl;
-        return {};
+        break;
     }
 }
 
-std::vector<uint8_t> isotp_handle_single_frame(const can_frame& frame) {
-    std::cout << "  <- CAN: Single Frame 수신" << std::endl;
+UdsMessage isotp_handle_single_frame(const canfd_frame& frame) {
+    if (g_config.log_messages) std::cout << "  <- CAN: Single Frame 수신" << std::endl;
     uint8_t len = frame.data[0] & 0x0F;
-    if (len == 0 || len > 7) return {}; // 잘못된 길이
-    return std::vector<uint8_t>(&frame.data[1], &frame.data[1] + len);
+    if (len == 0 && frame.len > CAN_MAX_DLEN) {
+        // CAN FD SF: 길이가 바이트 1에 있음
+        len = frame.data[1];
+        if (len == 0 || len + 2 > frame.len) return {};
+        return UdsMessage(&frame.data[2], len);
+    }
+    if (len == 0 || len > 7 || len >= frame.len) return {}; // 잘못된 길이
+    return UdsMessage(&frame.data[1], len);
+}
+
+void isotp_handle_first_frame(IsoTpLink& link, const canfd_frame& first_frame) {
+    if (g_config.log_messages) std::cout << "  <- CAN: First Frame 수신" << std::endl;
+    if (link.rx_active) {
+        std::cerr << "재조립 중 새 First Frame 수신. 이전 메시지를 버립니다." << std::endl;
+    }
+    if (first_frame.len < 8) {
+        std::cerr << "잘못된 First Frame 길이" << std::endl;
+        return;
+    }
+
+    // FF_DL=0이면 escape 형식: 바이트 2~5가 32비트 길이이고 데이터는 바이트 6부터 시작합니다.
+    size_t total_size = ((first_frame.data[0] & 0x0F) << 8) | first_frame.data[1];
+    size_t header_len = 2;
+    if (total_size == 0) {
+        uint32_t ff_dl;
+        memcpy(&ff_dl, &first_frame.data[2], 4);
+        total_size = ntohl(ff_dl);
+        header_len = 6;
+        if (total_size <= ISOTP_FF_DL_12BIT_MAX) {
+            std::cerr << "escape First Frame인데 길이가 4095 이하 (" << total_size << "). 무시합니다." << std::endl;
+            return;
+        }
+    }
+    else if (total_size <= 7) {
+        std::cerr << "잘못된 First Frame 길이" << std::endl;
+        return;
+    }
+    if (total_size > ISOTP_MAX_PDU) {
+        std::cerr << "First Frame 길이 " << total_size << " 바이트가 한도를 넘어 Overflow로 거절합니다." << std::endl;
+        isotp_send_flow_control(link, 0x02);
+        return;
+    }
+
+    // 버퍼는 CF가 들어오는 만큼 늘리고, 처음에는 12비트 FF 최대치만 예약합니다.
+    link.rx_expected = total_size;
+    link.rx_buffer.clear();
+    link.rx_buffer.reserve(std::min(total_size, ISOTP_FF_DL_12BIT_MAX));
+    link.rx_buffer.append(&first_frame.data[header_len], first_frame.len - header_len);
+    link.rx_seq = 1;
+    link.rx_active = true;
+
+    isotp_send_flow_control(link, 0x00);
+
+    // 응답 수신이 시작됐으므로 이후 감시는 CF 타임아웃이 맡습니다.
+    g_reactor.cancel_timer(link.response_timer);
+    isotp_arm_cf_timeout(link);
 }
 
-std::vector<uint8_t> isotp_handle_multi_frame(int sock, const can_frame& first_frame) {
-    std::cout << "  <- CAN: First Frame 수신" << std::endl;
-    uint16_t total_size = ((first_frame.data[0] & 0x0F) << 8) | first_frame.data[1];
+void isotp_handle_consecutive_frame(IsoTpLink& link, const canfd_frame& cf_frame) {
+    if (!link.rx_active) return; // 재조립 중이 아닐 때의 CF는 무시
+
+    if ((cf_frame.data[0] & 0x0F) != link.rx_seq || cf_frame.len < 2) {
+        link.metrics.cf_sequence_errors++;
+        isotp_abort_rx(link, "잘못된 순서의 CF 또는 예상치 못한 프레임 수신");
+        isotp_fc_backoff(link, "CF 순서 오류");
+        return;
+    }
 
-    std::vector<uint8_t> uds_rx_buffer;
-    uds_rx_buffer.reserve(total_size);
-    uds_rx_buffer.assign(&first_frame.data[2], &first_frame.data[first_frame.can_dlc]);
+    size_t bytes_to_copy = std::min(link.rx_expected - link.rx_buffer.size(), (size_t)(cf_frame.len - 1));
+    link.rx_buffer.append(&cf_frame.data[1], bytes_to_copy);
+    link.rx_seq = (link.rx_seq + 1) % 16;
 
-    isotp_send_flow_control(sock);
+    if (link.rx_buffer.size() < link.rx_expected) {
+        isotp_arm_cf_timeout(link); // 다음 CF 타임아웃 갱신
+        return;
+    }
 
-    uint8_t expected_seq_num = 1;
-    while (uds_rx_buffer.size() < total_size) {
-        can_frame cf_frame;
-        if (read(sock, &cf_frame, sizeof(can_frame)) <= 0) {
-            std::cerr << "CF 수신 중 타임아웃" << std::endl;
-            return {}; // 타임아웃
-        }
+    if (g_config.log_messages) std::cout << "  <- CAN: 모든 Consecutive Frame 수신 완료" << std::endl;
+    isotp_fc_on_success(link);
+    g_reactor.cancel_timer(link.rx_timer);
+    link.rx_active = false;
+    UdsMessage uds_response;
+    std::swap(uds_response, link.rx_buffer);
+    isotp_on_message(link, std::move(uds_response));
+}
 
-        if ((cf_frame.data[0] & 0xF0) != 0x20 || (cf_frame.data[0] & 0x0F) != expected_seq_num) {
-            std::cerr << "잘못된 순서의 CF 또는 예상치 못한 프레임 수신" << std::endl;
-            return {}; // 오류
-        }
+void isotp_arm_cf_timeout(IsoTpLink& link) {
+    g_reactor.cancel_timer(link.rx_timer);
+    link.rx_timer = g_reactor.add_timer_ms(CF_TIMEOUT_MS, [&link]() {
+        link.rx_timer = 0;
+        link.metrics.cf_timeouts++;
+        isotp_abort_rx(link, "CF 수신 중 타임아웃");
+        isotp_fc_backoff(link, "CF 타임아웃");
+    });
+}
 
-        uint16_t bytes_to_copy = std::min((uint16_t)(total_size - uds_rx_buffer.size()), (uint16_t)(cf_frame.can_dlc - 1));
-        uds_rx_buffer.insert(uds_rx_buffer.end(), &cf_frame.data[1], &cf_frame.data[1] + bytes_to_copy);
-        expected_seq_num = (expected_seq_num + 1) % 16;
+// flow_status: 0x00 = CTS, 0x02 = Overflow (수신할 수 없는 길이)
+void isotp_send_flow_control(IsoTpLink& link, uint8_t flow_status) {
+    canfd_frame fc_frame;
+    memset(&fc_frame, 0, sizeof(fc_frame));
+    fc_frame.can_id = link.cfg.tx_id; // 응답은 요청 ID로 보냄
+    fc_frame.len = 8;
+
+    fc_frame.data[0] = 0x30 | flow_status; // [FlowStatus]
+    fc_frame.data[1] = link.rx_fc_bs;      // [BlockSize: 0이면 한 번에 전부]
+    fc_frame.data[2] = link.rx_fc_stmin;   // [STmin]
+
+    can_write_frame(link, fc_frame);
+    if (flow_status != 0x00) {
+        std::cout << "  -> CAN: Flow Control(Overflow) 전송" << std::endl;
+        return;
+    }
+    if (g_config.log_messages) std::cout << "  -> CAN: Flow Control(CTS, BS=" << (int)link.rx_fc_bs << ", STmin=0x" << std::hex
+              << (int)link.rx_fc_stmin << std::dec << ") 전송" << std::endl;
+}
+
+// --- 적응형 FC ---
+// 오류 신호가 올 때만 STmin을 한 칸 늘리고, 한동안 문제없으면 다시 한 칸 줄입니다.
+void isotp_fc_backoff(IsoTpLink& link, const char* reason) {
+    link.fc_clean_streak = 0;
+    const int max_level = sizeof(ADAPTIVE_STMIN_STEPS) / sizeof(ADAPTIVE_STMIN_STEPS[0]) - 1;
+    if (!link.cfg.fc_adaptive || link.fc_level >= max_level) return;
+
+    link.fc_level++;
+    std::cerr << link.cfg.name << ": 적응형 FC 백오프 (" << reason << ") -> STmin=0x" << std::hex
+              << (int)ADAPTIVE_STMIN_STEPS[link.fc_level] << std::dec << std::endl;
+    isotp_fc_apply(link);
+}
+
+void isotp_fc_on_success(IsoTpLink& link) {
+    if (!link.cfg.fc_adaptive || link.fc_level == 0) return;
+    if (++link.fc_clean_streak < ADAPTIVE_FC_RECOVER_AFTER) return;
+
+    link.fc_clean_streak = 0;
+    link.fc_level--;
+    std::cout << link.cfg.name << ": 적응형 FC 복귀 -> STmin=0x" << std::hex
+              << (int)ADAPTIVE_STMIN_STEPS[link.fc_level] << std::dec << std::endl;
+    isotp_fc_apply(link);
+}
+
+void isotp_fc_apply(IsoTpLink& link) {
+    link.rx_fc_stmin = ADAPTIVE_STMIN_STEPS[link.fc_level];
+    if (link.isotp_sock < 0) return; // 유저스페이스 엔진은 다음 FC부터 바로 반영
+    link.fc_reopen_pending = true;
+    isotp_fc_try_reopen(link);
+}
+
+// 커널 소켓을 닫으면 그 안의 전송/재조립/수신 대기 메시지가 사라지므로, 송신이 없고 응답을 기다리지 않으며
+// 읽기 루프가 소켓을 다 비운 뒤에만 새 FC 값으로 다시 만듭니다.
+void isotp_fc_try_reopen(IsoTpLink& link) {
+    if (!link.fc_reopen_pending || link.isotp_sock < 0) return;
+    if (link.tx_state != IsoTpTxState::IDLE || link.awaiting_response || link.isotp_in_event) return;
+
+    link.fc_reopen_pending = false;
+    int sock = setup_isotp_socket(link);
+    if (sock < 0) {
+        std::cerr << link.cfg.name << ": CAN_ISOTP 소켓 재생성 실패. 이전 FC 값을 유지합니다." << std::endl;
+        return;
+    }
+    g_reactor.remove(link.isotp_sock);
+    close(link.isotp_sock);
+    link.isotp_sock = sock;
+    g_reactor.add(sock, EPOLLIN, [&link](uint32_t events) { on_isotp_socket_event(link, events); });
+}
+
+// 커널 수신 큐가 넘쳐 프레임이 유실됨: 수신 중이거나 응답을 기다리던 채널을 늦춥니다.
+void on_can_rx_overflow(uint32_t dropped) {
+    std::cerr << "CAN 수신 큐 오버플로 (" << dropped << " 프레임 유실)" << std::endl;
+    for (auto& entry : g_links) {
+        IsoTpLink& link = entry.second;
+        if (link.rx_active || link.awaiting_response) isotp_fc_backoff(link, "CAN 수신 오버플로");
     }
+}
+
+// 재조립 실패: 버퍼를 버리고, 응답을 기다리던 요청이 있으면 채널을 풀어줍니다.
+void isotp_abort_rx(IsoTpLink& link, const char* reason) {
+    std::cerr << reason << std::endl;
+    g_reactor.cancel_timer(link.rx_timer);
+    link.rx_active = false;
+    link.rx_buffer.clear();
 
-    std::cout << "  <- CAN: 모든 Consecutive Frame 수신 완료" << std::endl;
-    return uds_rx_buffer;
+    if (link.awaiting_response && link.response_timer == 0) {
+        link.awaiting_response = false;
+        dispatch_next_request(link);
+    }
 }
 
-void isotp_send_flow_control(int sock) {
-    can_frame fc_frame;
-    fc_frame.can_id = UDS_REQUEST_CAN_ID; // 응답은 요청 ID로 보냄
-    fc_frame.can_dlc = 8;
-    memset(fc_frame.data, 0, sizeof(fc_frame.data));
+// 재조립이 끝난 UDS 메시지 하나를 요청 세션으로 돌려보내고, 채널을 다음 요청에 넘깁니다.
+void isotp_on_message(IsoTpLink& link, UdsMessage uds_response) {
+    link.metrics.uds_rx_bytes += uds_response.size();
+    // 예약된 주기 DID는 요청과 상관없이 오므로 응답 대기 상태를 건드리지 않음
+    if (periodic_on_message(link, uds_response.data(), uds_response.size())) return;
+
+    if (!response_matches_inflight(link, uds_response)) {
+        link.metrics.stale_responses++;
+        std::cerr << link.cfg.name << ": 진행 중인 요청(SID 0x" << std::hex << (int)link.inflight_sid << ")과 맞지 않는 응답 0x"
+                  << (int)(uds_response.empty() ? 0 : uds_response[0]) << std::dec << " 버림." << std::endl;
+        return;
+    }
+
+    // 응답 지연(0x78): 채널을 계속 점유한 채 P2*까지 기다립니다. 가속기가 보낸 블록의 0x78은 진단기에 넘기지 않습니다.
+    bool response_pending = uds_response.size() >= 3 && uds_response[0] == 0x7F && uds_response[2] == 0x78;
+    if (response_pending && link.awaiting_response) {
+        response_timing_on_pending(link);
+        if (!link.owner_flash) forward_response_to_tester(link, std::move(uds_response));
+        return;
+    }
 
-    fc_frame.data[0] = 0x30; // [FlowStatus: CTS]
-    fc_frame.data[1] = 0x00; // [BlockSize: 0 (Send All)]
-    fc_frame.data[2] = 0x0A; // [STmin: 10ms]
+    if (link.owner_flash) {
+        if (response_pending) return;
+        flash_on_ecu_response(link, std::move(uds_response));
+    }
+    else {
+        if (uds_response[0] == 0x74) flash_on_download_accepted(link, uds_response);
+        did_cache_on_response(link, uds_response);
+        periodic_on_response(link, uds_response);
+        response_timing_on_session(link, uds_response);
+        keepalive_on_response(link, uds_response);
+        if (g_functional.active) functional_on_response(uds_response);
+        forward_response_to_tester(link, std::move(uds_response));
+    }
 
-    write(sock, &fc_frame, sizeof(can_frame));
-    std::cout << "  -> CAN: Flow Control(CTS) 전송" << std::endl;
-}
\ No newline at end of file
+    if (link.awaiting_response) {
+        g_reactor.cancel_timer(link.response_timer);
+        link.awaiting_response = false;
+        link.metrics.response_by_sid[link.inflight_sid].observe(
+            std::chrono::duration<double>(Clock::now() - link.request_sent_at).count());
+        dispatch_next_request(link);
+    }
+}
@@ -0,0 +1,558 @@
+// --- uds_gateway 벤치마크 ---
+// vcan 위에 모의 ECU(커널 CAN_ISOTP 소켓)를 띄우고, 루프백 TCP로 붙는 DoIP 진단기가 요청 묶음을 보내
+// 게이트웨이의 처리량과 왕복 지연(p50/p99/p99.9)을 재서 JSON으로 출력합니다. 실차(TC375) 없이 성능 회귀 확인용.
+//
+// 준비 (root):
+//   modprobe vcan && modprobe can-isotp           (64k 항목은 can-isotp max_pdu_size=70000 이상 필요)
+//   ip link add dev vcan0 type vcan && ip link set vcan0 up
+//   ip link set vcan0 mtu 72                      (--fd 사용 시)
+// 사용법:
+//   uds_gateway_bench [--gateway ./uds_gateway] [--iface vcan0] [--port 13401] [--count 1000] [--warmup 10]
+//                     [--mix sf,4k,64k,write4k] [--ecu-bs 0] [--ecu-stmin 0] [--gw-stmin 0]
+//                     [--gw-isotp user|kernel] [--gw-fc fixed|adaptive] [--fd]
+//                     [--no-spawn] [--no-ecu]
+//   --no-spawn: 이미 떠 있는 게이트웨이(포트 --port)에 붙음, --no-ecu: 모의 ECU를 띄우지 않음 (버스에 있는 ECU 사용)
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/isotp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+// --- 기본값 ---
+const char* BENCH_INTERFACE = "vcan0";
+const char* BENCH_GATEWAY = "./uds_gateway";
+const int BENCH_PORT = 13401;                       // 실제 게이트웨이(13400)와 겹치지 않도록
+const int BENCH_COUNT = 1000;
+const int BENCH_WARMUP = 10;
+const uint16_t BENCH_TESTER_ADDRESS = 0x0E00;
+const uint16_t BENCH_ECU_ADDRESS = 0x1000;
+const uint32_t BENCH_REQUEST_CAN_ID = 0x7E0;
+const uint32_t BENCH_RESPONSE_CAN_ID = 0x7E8;
+const int GATEWAY_START_TIMEOUT_MS = 3000;
+const int RESPONSE_TIMEOUT_MS = 5000;
+const size_t ECU_MAX_MESSAGE = 70000;
+
+// --- 요청 묶음 ---
+// 모의 ECU는 DID로 응답 크기를 정합니다 (0x22 → 0x62 DID [response_data 바이트], 0x2E → 0x6E DID).
+struct BenchMix {
+    const char* name;
+    uint8_t sid;
+    uint16_t did;
+    size_t request_data;  // SID/DID 뒤에 붙는 요청 데이터 길이
+    size_t response_data; // 응답의 SID/DID 뒤 데이터 길이
+};
+
+const BenchMix BENCH_MIXES[] = {
+    { "sf",      0x22, 0xB000, 0,    4 },     // 요청/응답 모두 Single Frame
+    { "4k",      0x22, 0xB001, 0,    4096 },  // 4KB 멀티 프레임 응답
+    { "64k",     0x22, 0xB002, 0,    65536 }, // escape FF가 필요한 64KB 응답
+    { "write4k", 0x2E, 0xB003, 4096, 0 },     // 4KB 멀티 프레임 요청
+};
+
+struct BenchOptions {
+    std::string gateway = BENCH_GATEWAY;
+    std::string iface = BENCH_INTERFACE;
+    int port = BENCH_PORT;
+    int count = BENCH_COUNT;
+    int warmup = BENCH_WARMUP;
+    std::vector<const BenchMix*> mixes;
+    uint8_t ecu_bs = 0;     // 모의 ECU가 게이트웨이에 보내는 FC
+    uint8_t ecu_stmin = 0;
+    uint8_t gw_stmin = 0;   // 게이트웨이가 모의 ECU에 보내는 FC (게이트웨이 기본값 0x0A면 4k 응답에만 약 6초)
+    std::string gw_isotp = "user";
+    std::string gw_fc = "fixed";
+    bool can_fd = false;
+    bool spawn_gateway = true;
+    bool run_ecu = true;
+};
+
+// 요청 하나의 결과: TIMEOUT이면 응답이 늦게 올 수 있어 다음 측정 전에 기다려 버림
+enum class RequestResult { OK, FAILED, TIMEOUT };
+
+struct MixResult {
+    const BenchMix* mix;
+    int requests = 0;
+    int errors = 0;
+    double elapsed_s = 0;
+    std::vector<double> latency_us;
+};
+
+std::atomic<bool> g_ecu_running{ true };
+
+// --- 함수 프로토타입 ---
+bool parse_options(int argc, char* argv[], BenchOptions& opt);
+const BenchMix* find_mix(const std::string& name);
+int setup_ecu_socket(const BenchOptions& opt);
+void ecu_loop(int sock);
+std::vector<uint8_t> ecu_respond(const uint8_t* req, size_t len);
+std::string write_gateway_config(const BenchOptions& opt);
+pid_t spawn_gateway(const BenchOptions& opt, const std::string& config_path);
+int connect_tester(int port, int timeout_ms);
+bool send_all(int fd, const uint8_t* data, size_t len);
+bool recv_doip(int fd, std::vector<uint8_t>& buf, uint16_t& type, std::vector<uint8_t>& payload, Clock::time_point deadline);
+bool activate_routing(int fd, std::vector<uint8_t>& buf);
+std::vector<uint8_t> build_request(const BenchMix& mix);
+int response_timeout_ms(const BenchMix& mix, const BenchOptions& opt);
+bool is_final_response(const std::vector<uint8_t>& payload, const BenchMix& mix);
+RequestResult run_request(int fd, std::vector<uint8_t>& buf, const std::vector<uint8_t>& msg, const BenchMix& mix, int timeout_ms);
+void settle_after_error(int fd, std::vector<uint8_t>& buf, const BenchMix& mix, RequestResult result, int timeout_ms);
+MixResult run_mix(int fd, std::vector<uint8_t>& buf, const BenchMix& mix, const BenchOptions& opt);
+double percentile(const std::vector<double>& sorted, double p);
+void print_json(const BenchOptions& opt, const std::vector<MixResult>& results);
+
+// --- 메인 함수 ---
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    BenchOptions opt;
+    if (!parse_options(argc, argv, opt)) return 2;
+
+    int ecu_sock = -1;
+    std::thread ecu_thread;
+    if (opt.run_ecu) {
+        ecu_sock = setup_ecu_socket(opt);
+        if (ecu_sock < 0) {
+            std::cerr << opt.iface << ": 모의 ECU CAN_ISOTP 소켓 생성 실패 (" << strerror(errno)
+                      << "). vcan/can-isotp 모듈을 확인하세요." << std::endl;
+            return 1;
+        }
+        ecu_thread = std::thread(ecu_loop, ecu_sock);
+    }
+
+    pid_t gateway_pid = -1;
+    std::string config_path;
+    if (opt.spawn_gateway) {
+        config_path = write_gateway_config(opt);
+        gateway_pid = config_path.empty() ? -1 : spawn_gateway(opt, config_path);
+        if (gateway_pid < 0) std::cerr << "게이트웨이 실행 실패: " << opt.gateway << std::endl;
+    }
+
+    int rc = 1;
+    int fd = (opt.spawn_gateway && gateway_pid < 0) ? -1 : connect_tester(opt.port, GATEWAY_START_TIMEOUT_MS);
+    std::vector<uint8_t> buf;
+    if (fd < 0) {
+        std::cerr << "게이트웨이(127.0.0.1:" << opt.port << ")에 연결하지 못했습니다." << std::endl;
+    }
+    else if (!activate_routing(fd, buf)) {
+        std::cerr << "라우팅 활성화 실패." << std::endl;
+    }
+    else {
+        std::vector<MixResult> results;
+        for (const BenchMix* mix : opt.mixes) {
+            std::cerr << "[bench] " << mix->name << " " << opt.count << "회..." << std::endl;
+            results.push_back(run_mix(fd, buf, *mix, opt));
+        }
+        print_json(opt, results);
+        rc = 0;
+        for (const MixResult& r : results) {
+            if (r.errors) rc = 1;
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    if (gateway_pid > 0) {
+        kill(gateway_pid, SIGTERM);
+        waitpid(gateway_pid, nullptr, 0);
+    }
+    if (!config_path.empty()) unlink(config_path.c_str());
+    g_ecu_running = false;
+    if (ecu_thread.joinable()) ecu_thread.join();
+    if (ecu_sock >= 0) close(ecu_sock);
+    return rc;
+}
+
+// --- 명령행 읽기 ---
+bool parse_options(int argc, char* argv[], BenchOptions& opt) {
+    std::string mixes = "sf,4k,64k,write4k";
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) throw std::invalid_argument(arg + " 값 없음");
+                return argv[++i];
+            };
+            if (arg == "--gateway") opt.gateway = value();
+            else if (arg == "--iface") opt.iface = value();
+            else if (arg == "--port") opt.port = std::stoi(value(), nullptr, 0);
+            else if (arg == "--count") opt.count = std::stoi(value(), nullptr, 0);
+            else if (arg == "--warmup") opt.warmup = std::stoi(value(), nullptr, 0);
+            else if (arg == "--mix") mixes = value();
+            else if (arg == "--ecu-bs") opt.ecu_bs = std::stoul(value(), nullptr, 0);
+            else if (arg == "--ecu-stmin") opt.ecu_stmin = std::stoul(value(), nullptr, 0);
+            else if (arg == "--gw-stmin") opt.gw_stmin = std::stoul(value(), nullptr, 0);
+            else if (arg == "--gw-isotp") opt.gw_isotp = value();
+            else if (arg == "--gw-fc") opt.gw_fc = value();
+            else if (arg == "--fd") opt.can_fd = true;
+            else if (arg == "--no-spawn") opt.spawn_gateway = false;
+            else if (arg == "--no-ecu") opt.run_ecu = false;
+            else throw std::invalid_argument(arg);
+        }
+        std::istringstream names(mixes);
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            const BenchMix* mix = find_mix(name);
+            if (!mix) throw std::invalid_argument("알 수 없는 mix: " + name);
+            opt.mixes.push_back(mix);
+        }
+        if (opt.count < 1 || opt.mixes.empty()) throw std::invalid_argument("--count/--mix");
+    }
+    catch (const std::exception& e) {
+        std::cerr << "인자 오류: " << e.what() << std::endl;
+        std::cerr << "사용법: " << argv[0] << " [--gateway ./uds_gateway] [--iface vcan0] [--port 13401] [--count 1000]"
+                  << " [--warmup 10] [--mix sf,4k,64k,write4k] [--ecu-bs 0] [--ecu-stmin 0]"
+                  << " [--gw-stmin 0] [--gw-isotp user|kernel] [--gw-fc fixed|adaptive] [--fd] [--no-spawn] [--no-ecu]" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+const BenchMix* find_mix(const std::string& name) {
+    for (const BenchMix& mix : BENCH_MIXES) {
+        if (name == mix.name) return &mix;
+    }
+    return nullptr;
+}
+
+// --- 모의 ECU (커널 CAN_ISOTP: 분할/조립과 FC는 커널이 처리) ---
+int setup_ecu_socket(const BenchOptions& opt) {
+    int sock = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP);
+    if (sock < 0) return -1;
+
+    can_isotp_fc_options fc{};
+    fc.bs = opt.ecu_bs;
+    fc.stmin = opt.ecu_stmin;
+    setsockopt(sock, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc, sizeof(fc));
+    if (opt.can_fd) {
+        can_isotp_ll_options ll{};
+        ll.mtu = CANFD_MTU;
+        ll.tx_dl = CANFD_MAX_DLEN;
+        ll.tx_flags = CANFD_BRS;
+        if (setsockopt(sock, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &ll, sizeof(ll)) < 0) {
+            int saved = errno; close(sock); errno = saved; return -1;
+        }
+    }
+
+    ifreq ifr;
+    strncpy(ifr.ifr_name, opt.iface.c_str(), IFNAMSIZ - 1);
+    ifr.ifr_name[IFNAMSIZ - 1] = '\0';
+    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+        int saved = errno; close(sock); errno = saved; return -1;
+    }
+    sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    addr.can_addr.tp.tx_id = BENCH_RESPONSE_CAN_ID; // ECU -> 게이트웨이
+    addr.can_addr.tp.rx_id = BENCH_REQUEST_CAN_ID;  // 게이트웨이 -> ECU
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        int saved = errno; close(sock); errno = saved; return -1;
+    }
+    return sock;
+}
+
+void ecu_loop(int sock) {
+    std::vector<uint8_t> req(ECU_MAX_MESSAGE);
+    while (g_ecu_running) {
+        pollfd pfd{ sock, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        ssize_t n = read(sock, req.data(), req.size());
+        if (n <= 0) continue;
+        std::vector<uint8_t> resp = ecu_respond(req.data(), n);
+        if (resp.empty()) continue;
+        if (write(sock, resp.data(), resp.size()) != (ssize_t)resp.size()) {
+            std::cerr << "[ECU] 응답 송신 실패 (" << resp.size() << " 바이트): " << strerror(errno) << std::endl;
+        }
+    }
+}
+
+std::vector<uint8_t> ecu_respond(const uint8_t* req, size_t len) {
+    if (len >= 2 && req[0] == 0x3E) {
+        if (req[1] & 0x80) return {};
+        return { 0x7E, req[1] };
+    }
+    if (len >= 3 && (req[0] == 0x22 || req[0] == 0x2E)) {
+        uint16_t did = (req[1] << 8) | req[2];
+        for (const BenchMix& mix : BENCH_MIXES) {
+            if (mix.sid != req[0] || mix.did != did) continue;
+            if (len != 3 + mix.request_data) break;
+            std::vector<uint8_t> resp = { (uint8_t)(req[0] + 0x40), req[1], req[2] };
+            resp.resize(3 + mix.response_data);
+            for (size_t i = 0; i < mix.response_data; ++i) resp[3 + i] = (uint8_t)i;
+            return resp;
+        }
+        return { 0x7F, req[0], 0x31 }; // requestOutOfRange
+    }
+    return { 0x7F, len ? req[0] : (uint8_t)0, 0x11 }; // serviceNotSupported
+}
+
+// --- 게이트웨이 실행 ---
+// 벤치마크용 설정을 임시 파일로 쓰고 게이트웨이를 자식 프로세스로 띄웁니다.
+// 게이트웨이의 프레임 단위 로그가 측정에 섞이지 않도록 출력은 /dev/null로 보냅니다.
+std::string write_gateway_config(const BenchOptions& opt) {
+    char path[] = "/tmp/uds_gateway_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return "";
+    close(fd);
+
+    // 커널 백엔드는 응답 전체를 받은 뒤에야 알려 주므로 P2*를 가장 긴 응답의 전송 시간에 맞춥니다.
+    int p2_star_ms = 0;
+    for (const BenchMix* mix : opt.mixes) p2_star_ms = std::max(p2_star_ms, response_timeout_ms(*mix, opt));
+
+    std::ofstream out(path);
+    out << "interface " << opt.iface << "\n"
+        << "port " << opt.port << "\n"
+        << "isotp " << opt.gw_isotp << "\n"
+        << "ecu BENCH address=0x" << std::hex << BENCH_ECU_ADDRESS
+        << " tx=0x" << BENCH_REQUEST_CAN_ID << " rx=0x" << BENCH_RESPONSE_CAN_ID
+        << " stmin=0x" << (int)opt.gw_stmin << std::dec << " p2star=" << p2_star_ms
+        << " fc=" << opt.gw_fc << (opt.can_fd ? " can=fd" : "") << "\n";
+    if (!out) {
+        unlink(path);
+        return "";
+    }
+    return path;
+}
+
+pid_t spawn_gateway(const BenchOptions& opt, const std::string& config_path) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+    execl(opt.gateway.c_str(), opt.gateway.c_str(), config_path.c_str(), (char*)nullptr);
+    _exit(127);
+}
+
+// --- DoIP 진단기 ---
+int connect_tester(int port, int timeout_ms) {
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    while (true) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            return fd;
+        }
+        close(fd);
+        if (Clock::now() >= deadline) return -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20)); // 게이트웨이가 리슨할 때까지
+    }
+}
+
+bool send_all(int fd, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// DoIP 메시지 하나를 받을 때까지 읽습니다. buf에는 다음 메시지의 앞부분이 남을 수 있습니다.
+bool recv_doip(int fd, std::vector<uint8_t>& buf, uint16_t& type, std::vector<uint8_t>& payload, Clock::time_point deadline) {
+    while (true) {
+        if (buf.size() >= 8) {
+            uint32_t length = ((uint32_t)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+            if (buf.size() >= 8 + length) {
+                type = (buf[2] << 8) | buf[3];
+                payload.assign(buf.begin() + 8, buf.begin() + 8 + length);
+                buf.erase(buf.begin(), buf.begin() + 8 + length);
+                return true;
+            }
+        }
+        int wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        pollfd pfd{ fd, POLLIN, 0 };
+        if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) return false;
+        uint8_t chunk[65536];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) return false;
+        buf.insert(buf.end(), chunk, chunk + n);
+    }
+}
+
+bool activate_routing(int fd, std::vector<uint8_t>& buf) {
+    uint8_t msg[8 + 7] = { 0x02, 0xFD, 0x00, 0x05, 0x00, 0x00, 0x00, 0x07,
+                           BENCH_TESTER_ADDRESS >> 8, BENCH_TESTER_ADDRESS & 0xFF, 0x00, 0, 0, 0, 0 };
+    if (!send_all(fd, msg, sizeof(msg))) return false;
+    uint16_t type;
+    std::vector<uint8_t> payload;
+    if (!recv_doip(fd, buf, type, payload, Clock::now() + std::chrono::milliseconds(RESPONSE_TIMEOUT_MS))) return false;
+    return type == 0x0006 && payload.size() >= 5 && payload[4] == 0x10;
+}
+
+std::vector<uint8_t> build_request(const BenchMix& mix) {
+    uint32_t length = 4 + 3 + mix.request_data;
+    std::vector<uint8_t> msg = { 0x02, 0xFD, 0x80, 0x01,
+                                 (uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length,
+                                 BENCH_TESTER_ADDRESS >> 8, BENCH_TESTER_ADDRESS & 0xFF,
+                                 BENCH_ECU_ADDRESS >> 8, BENCH_ECU_ADDRESS & 0xFF,
+                                 mix.sid, (uint8_t)(mix.did >> 8), (uint8_t)(mix.did & 0xFF) };
+    for (size_t i = 0; i < mix.request_data; ++i) msg.push_back((uint8_t)i);
+    return msg;
+}
+
+// STmin 바이트 → CF 하나당 최소 간격(ms). 100~900us 값은 1ms로 올려 잡습니다.
+int stmin_ms(uint8_t stmin) {
+    if (stmin <= 0x7F) return stmin;
+    if (stmin >= 0xF1 && stmin <= 0xF9) return 1;
+    return 0x7F; // 예약 값은 최대 간격으로 취급 (ISO 15765-2)
+}
+
+// 멀티 프레임 전송 시간은 CF 수 × STmin이므로 고정 타임아웃에 요청/응답 크기만큼 여유를 더합니다.
+// 요청은 모의 ECU의 FC(--ecu-stmin), 응답은 게이트웨이의 FC(--gw-stmin)에 맞춰 나갑니다.
+int response_timeout_ms(const BenchMix& mix, const BenchOptions& opt) {
+    size_t cf_payload = opt.can_fd ? 63 : 7;
+    size_t request_frames = (3 + mix.request_data + cf_payload - 1) / cf_payload;
+    size_t response_frames = (3 + mix.response_data + cf_payload - 1) / cf_payload;
+    return RESPONSE_TIMEOUT_MS + (int)(request_frames * stmin_ms(opt.ecu_stmin) + response_frames * stmin_ms(opt.gw_stmin));
+}
+
+bool is_final_response(const std::vector<uint8_t>& payload, const BenchMix& mix) {
+    if (payload.size() < 5) return false;
+    if (payload[4] == 0x7F) return payload.size() >= 7 && payload[5] == mix.sid && payload[6] != 0x78;
+    return payload[4] == (uint8_t)(mix.sid + 0x40);
+}
+
+// 요청 하나를 보내고 ACK(0x8002) 뒤 최종 응답(0x78 제외)까지 기다립니다. 응답 길이까지 맞아야 성공.
+// SID가 다른 응답(앞 mix에서 늦게 온 것)은 건너뜁니다.
+RequestResult run_request(int fd, std::vector<uint8_t>& buf, const std::vector<uint8_t>& msg, const BenchMix& mix, int timeout_ms) {
+    if (!send_all(fd, msg.data(), msg.size())) return RequestResult::FAILED;
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    uint16_t type;
+    std::vector<uint8_t> payload;
+    while (recv_doip(fd, buf, type, payload, deadline)) {
+        if (type == 0x8002) continue;
+        if (type != 0x8001) return RequestResult::FAILED; // NACK 등
+        if (!is_final_response(payload, mix)) continue;
+        bool ok = payload.size() == 4 + 3 + mix.response_data && payload[4] == (uint8_t)(mix.sid + 0x40);
+        return ok ? RequestResult::OK : RequestResult::FAILED;
+    }
+    return RequestResult::TIMEOUT;
+}
+
+// 타임아웃 뒤 늦게 오는 응답이 다음 요청의 응답으로 잡혀 지연이 어긋나지 않도록, 그 응답을 한 번 더
+// 타임아웃만큼 기다려 버린 뒤 다음 요청을 보냅니다. 실패하면 수신 버퍼에 남은 조각도 비웁니다.
+void settle_after_error(int fd, std::vector<uint8_t>& buf, const BenchMix& mix, RequestResult result, int timeout_ms) {
+    if (result == RequestResult::TIMEOUT) {
+        auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        uint16_t type;
+        std::vector<uint8_t> payload;
+        while (recv_doip(fd, buf, type, payload, deadline)) {
+            if (type == 0x8001 && is_final_response(payload, mix)) break;
+        }
+    }
+    if (result != RequestResult::OK) buf.clear();
+}
+
+MixResult run_mix(int fd, std::vector<uint8_t>& buf, const BenchMix& mix, const BenchOptions& opt) {
+    MixResult result;
+    result.mix = &mix;
+    std::vector<uint8_t> msg = build_request(mix);
+    int timeout_ms = response_timeout_ms(mix, opt);
+    for (int i = 0; i < opt.warmup; ++i) {
+        RequestResult r = run_request(fd, buf, msg, mix, timeout_ms);
+        settle_after_error(fd, buf, mix, r, timeout_ms);
+    }
+
+    result.latency_us.reserve(opt.count);
+    auto start = Clock::now();
+    for (int i = 0; i < opt.count; ++i) {
+        auto t0 = Clock::now();
+        RequestResult r = run_request(fd, buf, msg, mix, timeout_ms);
+        auto t1 = Clock::now();
+        result.requests++;
+        if (r != RequestResult::OK) {
+            result.errors++;
+            settle_after_error(fd, buf, mix, r, timeout_ms);
+            continue;
+        }
+        result.latency_us.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+    }
+    result.elapsed_s = std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(result.latency_us.begin(), result.latency_us.end());
+    return result;
+}
+
+// nearest-rank 백분위수
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// --- 결과 출력 (JSON) ---
+void print_json(const BenchOptions& opt, const std::vector<MixResult>& results) {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << "{\n"
+        << "  \"interface\": \"" << opt.iface << "\",\n"
+        << "  \"can_fd\": " << (opt.can_fd ? "true" : "false") << ",\n"
+        << "  \"gateway_isotp\": \"" << opt.gw_isotp << "\",\n"
+        << "  \"gateway_fc\": \"" << opt.gw_fc << "\",\n"
+        << "  \"ecu_bs\": " << (int)opt.ecu_bs << ",\n"
+        << "  \"ecu_stmin\": " << (int)opt.ecu_stmin << ",\n"
+        << "  \"gateway_stmin\": " << (int)opt.gw_stmin << ",\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const MixResult& r = results[i];
+        size_t ok = r.latency_us.size();
+        double bytes = (double)ok * (3 + r.mix->request_data + 3 + r.mix->response_data);
+        double mean = 0;
+        for (double v : r.latency_us) mean += v;
+        if (ok) mean /= ok;
+        out << "    {\"mix\": \"" << r.mix->name << "\""
+            << ", \"request_bytes\": " << 3 + r.mix->request_data
+            << ", \"response_bytes\": " << 3 + r.mix->response_data
+            << ", \"requests\": " << r.requests
+            << ", \"errors\": " << r.errors
+            << ", \"elapsed_s\": " << std::setprecision(3) << r.elapsed_s
+            << ", \"requests_per_s\": " << std::setprecision(1) << (r.elapsed_s > 0 ? ok / r.elapsed_s : 0)
+            << ", \"throughput_kib_s\": " << (r.elapsed_s > 0 ? bytes / 1024 / r.elapsed_s : 0)
+            << ", \"latency_us\": {\"p50\": " << percentile(r.latency_us, 0.50)
+            << ", \"p99\": " << percentile(r.latency_us, 0.99)
+            << ", \"p999\": " << percentile(r.latency_us, 0.999)
+            << ", \"mean\": " << mean
+            << ", \"max\": " << (ok ? r.latency_us.back() : 0) << "}}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    std::cout << out.str();
+}